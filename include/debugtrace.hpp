@@ -7,18 +7,34 @@
 #ifdef DEBUGTRACE_ENABLED
     #include <algorithm>
     #include <array>
+    #include <atomic>
+    #include <cerrno>
+    #include <cfloat>
+    #include <chrono>
+    #include <cmath>
+    #include <condition_variable>
     #include <cstdlib>
     #include <cstring>
     #include <ctime>
     #include <deque>
+    #include <exception>
+    #include <functional>
     #include <iomanip>
     #include <iostream>
+    #include <limits>
     #include <list>
     #include <map>
     #include <memory>
+    #include <mutex>
     #include <set>
+    #include <csignal>
     #include <cstdarg>
+    #include <cstdint>
+    #include <cstdio>
     #include <string>
+    #include <thread>
+    #include <typeindex>
+    #include <typeinfo>
     #ifdef __GNUG__
         #include <cxxabi.h> // abi::__cxa_demangle()
     #endif
@@ -27,8 +43,25 @@
     #include <vector>
     #if defined _WIN32
         #include <windows.h>
+        #include <fcntl.h>
+        #include <io.h>     // _open(), _write(), _close()
     #else
         #include <cuchar>
+        #include <fcntl.h>  // open()
+        #include <signal.h> // sigaction()
+        #include <unistd.h> // getpid(), write(), close()
+        #if defined __linux__
+            #include <poll.h>        // poll()
+            #include <sys/inotify.h> // inotify_init1()
+        #endif
+    #endif
+    #if __cplusplus >= 201703L && defined __has_include
+        #if __has_include(<charconv>)
+            #include <charconv> // std::to_chars() (shortest round-trip if __cpp_lib_to_chars is defined)
+        #endif
+        #if __has_include(<string_view>)
+            #include <string_view>
+        #endif
     #endif
 
     #if defined __clang__
@@ -52,8 +85,41 @@
     #define DEBUGTRACE_VARNAME_VALUE_SEPARATOR   " = "
     #define DEBUGTRACE_PAIR_SEPARATOR            ": "
     #define DEBUGTRACE_LOG_DATETIME_FORMAT       "%Y-%m-%d %H:%M:%S%z"
+    #define DEBUGTRACE_LOG_DATETIME_PRECISION    0
     #define DEBUGTRACE_MAXIMUM_DATA_OUTPUT_WIDTH 80
     #define DEBUGTRACE_COLLECTION_LIMIT          256
+    #define DEBUGTRACE_COLLECTION_TAIL_LIMIT     0
+    #define DEBUGTRACE_STRING_LIMIT              8192
+    #define DEBUGTRACE_MAXIMUM_DATA_OUTPUT_SIZE  65536
+    #define DEBUGTRACE_MAXIMUM_DATA_NEST_LEVEL   16
+    #define DEBUGTRACE_THREAD_TAG_ENABLED        false
+    #define DEBUGTRACE_PRINT_LOCATION_ENABLED    false
+    #define DEBUGTRACE_ASYNC_QUEUE_CAPACITY      8192
+    #define DEBUGTRACE_ASYNC_OVERFLOW_POLICY     debugtrace::overflow_policy::block
+    #define DEBUGTRACE_ASYNC_BATCH_SIZE          256
+    #define DEBUGTRACE_BINARY_BUFFER_SIZE        65536
+    #define DEBUGTRACE_BINARY_MAGIC              "DTRACE01"
+    // the switches at startup can be given on the command line (e.g. -DDEBUGTRACE_START_ENABLED=false)
+    #ifndef DEBUGTRACE_START_ENABLED
+        #define DEBUGTRACE_START_ENABLED         true
+    #endif
+    #ifndef DEBUGTRACE_START_CATEGORIES
+        #define DEBUGTRACE_START_CATEGORIES      debugtrace::category::all
+    #endif
+    #define DEBUGTRACE_SAMPLING_SUMMARY_INTERVAL 1000
+    #define DEBUGTRACE_CHROME_BUFFER_SIZE        65536
+    #define DEBUGTRACE_FILE_SINK_BUFFER_SIZE     65536
+    #define DEBUGTRACE_FLUSH_POLICY              debugtrace::flush_policy::every_line
+    #define DEBUGTRACE_FLUSH_BYTES               65536
+    #define DEBUGTRACE_FLUSH_INTERVAL            100
+    #define DEBUGTRACE_FLUSH_ON_FATAL_SIGNAL     true
+    #define DEBUGTRACE_FLIGHT_RECORDER_CAPACITY  1024
+    #define DEBUGTRACE_FLIGHT_RECORD_TEXT_SIZE   96
+    #define DEBUGTRACE_FLIGHT_RECORDER_DESCRIPTOR 2
+    #define DEBUGTRACE_SLOW_CALL_THRESHOLD       1000000
+    #define DEBUGTRACE_SLOW_CALL_BUFFER_SIZE     1048576
+    #define DEBUGTRACE_FILTER_VARIABLE           "DEBUGTRACE_FILTER"
+    #define DEBUGTRACE_CONFIGURATION_CHECK_INTERVAL 1000
 
     #ifdef __cpp_inline_variables
         #define DEBUGTRACE_VARIABLES
@@ -72,38 +138,714 @@
             const char*       varname_value_separator   = DEBUGTRACE_VARNAME_VALUE_SEPARATOR;\
             const char*       pair_separator            = DEBUGTRACE_PAIR_SEPARATOR;\
             const char*       log_datetime_format       = DEBUGTRACE_LOG_DATETIME_FORMAT;\
+            int               log_datetime_precision    = DEBUGTRACE_LOG_DATETIME_PRECISION;\
             size_t            maximum_data_output_width = DEBUGTRACE_MAXIMUM_DATA_OUTPUT_WIDTH;\
             size_t            collection_limit          = DEBUGTRACE_COLLECTION_LIMIT;\
-            bool              _initialized              = false;\
-            std::ostream&     output_stream             = std::cerr;\
-            int               _code_nest_level          = 0;\
-            int               _before_code_nest_level   = 0;\
-            int               _data_nest_level          = 0;\
+            size_t            collection_tail_limit     = DEBUGTRACE_COLLECTION_TAIL_LIMIT;\
+            size_t            string_limit              = DEBUGTRACE_STRING_LIMIT;\
+            size_t            maximum_data_output_size  = DEBUGTRACE_MAXIMUM_DATA_OUTPUT_SIZE;\
+            int               maximum_data_nest_level   = DEBUGTRACE_MAXIMUM_DATA_NEST_LEVEL;\
+            bool              thread_tag_enabled        = DEBUGTRACE_THREAD_TAG_ENABLED;\
+            bool              print_location_enabled    = DEBUGTRACE_PRINT_LOCATION_ENABLED;\
+            std::atomic<unsigned int> _trace_mask               {(DEBUGTRACE_START_ENABLED ? _master_switch : 0u) | DEBUGTRACE_START_CATEGORIES};\
+            int               sampling_summary_interval = DEBUGTRACE_SAMPLING_SUMMARY_INTERVAL;\
+            std::atomic<bool> _initialized              {false};\
+            std::shared_ptr<Sink> _sink                 {std::make_shared<StreamSink>(std::cerr)};\
+            std::mutex        _output_mutex;\
+            std::atomic<unsigned int> _thread_count     {0};\
+            size_t            async_queue_capacity      = DEBUGTRACE_ASYNC_QUEUE_CAPACITY;\
+            overflow_policy   async_overflow_policy     = DEBUGTRACE_ASYNC_OVERFLOW_POLICY;\
+            size_t            async_batch_size          = DEBUGTRACE_ASYNC_BATCH_SIZE;\
+            flush_policy      sink_flush_policy         = DEBUGTRACE_FLUSH_POLICY;\
+            size_t            flush_bytes               = DEBUGTRACE_FLUSH_BYTES;\
+            int               flush_interval            = DEBUGTRACE_FLUSH_INTERVAL;\
+            bool              flush_on_fatal_signal     = DEBUGTRACE_FLUSH_ON_FATAL_SIGNAL;\
+            size_t            _unflushed_bytes          = 0;\
+            std::atomic<_FlushTimer*> _flush_timer              {nullptr};\
+            std::atomic<_AsyncWriter*> _async_writer             {nullptr};\
+            std::atomic<unsigned int> _call_site_count          {0};\
+            size_t            binary_buffer_size        = DEBUGTRACE_BINARY_BUFFER_SIZE;\
+            std::atomic<bool> _binary_recording         {false};\
+            std::atomic<unsigned int> _binary_generation        {0};\
+            std::FILE*        _binary_file              = nullptr;\
+            std::mutex        _binary_mutex;\
+            std::atomic<bool> _profiling                {false};\
+            std::mutex        _profile_mutex;\
+            std::vector<_Context*> _profile_contexts;\
+            std::vector<std::unique_ptr<_ProfileStats>> _profile_totals;\
+            size_t            chrome_buffer_size        = DEBUGTRACE_CHROME_BUFFER_SIZE;\
+            std::atomic<bool> _chrome_tracing           {false};\
+            std::atomic<unsigned int> _chrome_generation        {0};\
+            std::FILE*        _chrome_file              = nullptr;\
+            std::mutex        _chrome_mutex;\
+            size_t            flight_recorder_capacity  = DEBUGTRACE_FLIGHT_RECORDER_CAPACITY;\
+            int               flight_recorder_descriptor = DEBUGTRACE_FLIGHT_RECORDER_DESCRIPTOR;\
+            std::atomic<bool> _flight_recording         {false};\
+            std::atomic<bool> _flight_crash_dumped      {false};\
+            std::atomic<_FlightRing*> _flight_rings             {nullptr};\
+            std::atomic<_FlightCursors*> _flight_cursors           {nullptr};\
+            std::mutex        _flight_ring_mutex;\
+            std::atomic<bool> _flight_dumping           {false};\
+            long              _flight_utc_offset        = 0;\
+            std::array<char, 8> _flight_zone              {};\
+            long long         slow_call_threshold       = DEBUGTRACE_SLOW_CALL_THRESHOLD;\
+            size_t            slow_call_buffer_size     = DEBUGTRACE_SLOW_CALL_BUFFER_SIZE;\
+            std::atomic<bool> _slow_call_capture        {false};\
+            std::atomic<unsigned int> _filter_generation        {1};\
+            int               configuration_check_interval = DEBUGTRACE_CONFIGURATION_CHECK_INTERVAL;\
+            std::atomic<const _Configuration*> _configuration            {nullptr};\
+            std::mutex        _configuration_mutex;\
+            std::atomic<unsigned int> _configuration_generation {1};\
+            std::atomic<unsigned int> _configuration_readers[2];\
+            std::atomic<size_t> _configured_collection_limit {SIZE_MAX};\
+            std::atomic<size_t> _configured_maximum_data_output_width {SIZE_MAX};\
+            std::atomic<_ConfigurationWatcher*> _configuration_watcher    {nullptr};\
+            thread_local _Context _context;\
             unsigned int      _code_page                = 65001;\
             }
     #endif // __cpp_inline_variables
 
     #ifdef __PRETTY_FUNCTION__
         // GCC, Clang
-        #define DEBUGTRACE_ENTER debugtrace::_DebugTrace _trace(__PRETTY_FUNCTION__, __FILE__, __LINE__);
+        #define DEBUGTRACE_FUNCTION_NAME __PRETTY_FUNCTION__
     #elif defined __FUNCSIG__
         // Visual C++
-        #define DEBUGTRACE_ENTER debugtrace::_DebugTrace _trace(__FUNCSIG__, __FILE__, __LINE__);
+        #define DEBUGTRACE_FUNCTION_NAME __FUNCSIG__
     #else
         // Others
-        #define DEBUGTRACE_ENTER debugtrace::_DebugTrace _trace(__func__, __FILE__, __LINE__);
+        #define DEBUGTRACE_FUNCTION_NAME __func__
     #endif // __PRETTY_FUNCTION__
-    #define DEBUGTRACE_MESSAGE(message) debugtrace::print_message(message, __FILE__, __LINE__);
-    #define DEBUGTRACE_PRINT(var) debugtrace::print(#var, var, __FILE__, __LINE__);
+    #if defined __GNUC__ || defined __clang__
+        #define DEBUGTRACE_FUNCTION_SIGNATURE __PRETTY_FUNCTION__
+    #elif defined _MSC_VER
+        #define DEBUGTRACE_FUNCTION_SIGNATURE __FUNCSIG__
+    #else
+        #define DEBUGTRACE_FUNCTION_SIGNATURE __func__
+    #endif
+    #if defined __GNUC__ || defined __clang__
+        #define DEBUGTRACE_UNLIKELY(condition) __builtin_expect(!!(condition), 0)
+    #else
+        #define DEBUGTRACE_UNLIKELY(condition) (condition)
+    #endif
+    // true if tracing of the category is enabled at run time
+    #define DEBUGTRACE_IS_ENABLED(category) DEBUGTRACE_UNLIKELY(debugtrace::_is_enabled(category))
+    // the offset of the base name in __FILE__ (evaluated at compile time as a template argument)
+    #define DEBUGTRACE_BASE_NAME_OFFSET std::integral_constant<size_t, debugtrace::_get_base_name_offset(__FILE__)>::value
+    #define DEBUGTRACE_ENTER \
+        static debugtrace::_CallSite _debugtrace_site(DEBUGTRACE_FUNCTION_NAME, DEBUGTRACE_FUNCTION_SIGNATURE, __FILE__, DEBUGTRACE_BASE_NAME_OFFSET, __LINE__);\
+        debugtrace::_DebugTrace _trace(_debugtrace_site);
+    #define DEBUGTRACE_ENTER_SAMPLING(sampling, parameter) \
+        static debugtrace::_CallSite _debugtrace_site(DEBUGTRACE_FUNCTION_NAME, DEBUGTRACE_FUNCTION_SIGNATURE, __FILE__, DEBUGTRACE_BASE_NAME_OFFSET, __LINE__);\
+        static debugtrace::_Sampler _debugtrace_sampler(debugtrace::_Sampler::kind::sampling, parameter);\
+        debugtrace::_DebugTrace _trace(_debugtrace_site, _debugtrace_sampler);
+    #define DEBUGTRACE_ENTER_SLOW(nanoseconds) \
+        static debugtrace::_CallSite _debugtrace_site(DEBUGTRACE_FUNCTION_NAME, DEBUGTRACE_FUNCTION_SIGNATURE, __FILE__, DEBUGTRACE_BASE_NAME_OFFSET, __LINE__,\
+            nullptr, 0, 1, (long long)(nanoseconds));\
+        debugtrace::_DebugTrace _trace(_debugtrace_site);
+    #define DEBUGTRACE_ENTER_EVERY(n)                 DEBUGTRACE_ENTER_SAMPLING(every, n)
+    #define DEBUGTRACE_ENTER_SAMPLED(fraction)        DEBUGTRACE_ENTER_SAMPLING(probability, fraction)
+    #define DEBUGTRACE_ENTER_RATE(max_per_second)     DEBUGTRACE_ENTER_SAMPLING(rate, max_per_second)
+    #define DEBUGTRACE_MESSAGE(text) {\
+        if (DEBUGTRACE_IS_ENABLED(debugtrace::category::message)) {\
+            static debugtrace::_CallSite _debugtrace_site(DEBUGTRACE_FUNCTION_NAME, DEBUGTRACE_FUNCTION_SIGNATURE, __FILE__, DEBUGTRACE_BASE_NAME_OFFSET, __LINE__);\
+            if (debugtrace::_is_selected(_debugtrace_site))\
+                debugtrace::print_message(_debugtrace_site, text);\
+        }\
+    }
+    #define DEBUGTRACE_PRINT(...) {\
+        if (DEBUGTRACE_IS_ENABLED(debugtrace::category::print)) {\
+            static debugtrace::_CallSite _debugtrace_site(DEBUGTRACE_FUNCTION_NAME, DEBUGTRACE_FUNCTION_SIGNATURE, __FILE__, DEBUGTRACE_BASE_NAME_OFFSET, __LINE__, #__VA_ARGS__,\
+                decltype(debugtrace::_get_binary_type(__VA_ARGS__))::value, decltype(debugtrace::_get_value_count(__VA_ARGS__))::value);\
+            if (debugtrace::_is_selected(_debugtrace_site))\
+                debugtrace::print(_debugtrace_site, __VA_ARGS__);\
+        }\
+    }
+    #define DEBUGTRACE_PRINT_SAMPLING(sampling, parameter, var) {\
+        if (DEBUGTRACE_IS_ENABLED(debugtrace::category::print)) {\
+            static debugtrace::_CallSite _debugtrace_site(DEBUGTRACE_FUNCTION_NAME, DEBUGTRACE_FUNCTION_SIGNATURE, __FILE__, DEBUGTRACE_BASE_NAME_OFFSET, __LINE__, #var,\
+                debugtrace::_BinaryType<typename std::decay<decltype(var)>::type>::value);\
+            static debugtrace::_Sampler _debugtrace_sampler(debugtrace::_Sampler::kind::sampling, parameter);\
+            if (debugtrace::_is_selected(_debugtrace_site) && _debugtrace_sampler.sample(_debugtrace_site))\
+                debugtrace::print(_debugtrace_site, var);\
+        }\
+    }
+    #define DEBUGTRACE_PRINT_EVERY(n, var)             DEBUGTRACE_PRINT_SAMPLING(every, n, var)
+    #define DEBUGTRACE_PRINT_SAMPLED(fraction, var)    DEBUGTRACE_PRINT_SAMPLING(probability, fraction, var)
+    #define DEBUGTRACE_PRINT_RATE(max_per_second, var) DEBUGTRACE_PRINT_SAMPLING(rate, max_per_second, var)
 #else
     #define DEBUGTRACE_VARIABLES
     #define DEBUGTRACE_ENTER
     #define DEBUGTRACE_MESSAGE(message)
-    #define DEBUGTRACE_PRINT(var)
+    #define DEBUGTRACE_PRINT(...)
+    #define DEBUGTRACE_ENTER_SLOW(nanoseconds)
+    #define DEBUGTRACE_ENTER_EVERY(n)
+    #define DEBUGTRACE_ENTER_SAMPLED(fraction)
+    #define DEBUGTRACE_ENTER_RATE(max_per_second)
+    #define DEBUGTRACE_PRINT_EVERY(n, var)
+    #define DEBUGTRACE_PRINT_SAMPLED(fraction, var)
+    #define DEBUGTRACE_PRINT_RATE(max_per_second, var)
 #endif // DEBUGTRACE_ENABLED
 
 #ifdef DEBUGTRACE_ENABLED
 namespace debugtrace {
+/// The policy applied when the asynchronous output queue is full.
+enum class overflow_policy {
+    block,           // waits until the queue has room
+    drop_newest,     // discards the record to be added
+    overwrite_oldest // discards the oldest record in the queue
+};
+
+/// The policy of flushing the sink.
+enum class flush_policy {
+    every_line, // flushes after every line (after every batch in the asynchronous mode)
+    bytes,      // flushes when flush_bytes bytes have been written since the last flush
+    interval,   // flushes every flush_interval milliseconds on a background thread
+    message     // flushes after DEBUGTRACE_MESSAGE lines and when flush_bytes bytes have been written
+};
+
+class _AsyncWriter;
+class _FlushTimer;
+class _ConfigurationWatcher;
+
+/// The categories of trace output which can be enabled or disabled at run time.
+namespace category {
+    constexpr unsigned int enter   = 1u << 0; // DEBUGTRACE_ENTER
+    constexpr unsigned int print   = 1u << 1; // DEBUGTRACE_PRINT
+    constexpr unsigned int message = 1u << 2; // DEBUGTRACE_MESSAGE
+    constexpr unsigned int all     = enter | print | message;
+} // namespace category
+
+/// The bit of _trace_mask which enables or disables all categories.
+constexpr unsigned int _master_switch = 1u << 31;
+
+/// The destination of log lines.
+/// Lines are handed over as byte spans of one or more lines terminated with '\n',
+/// so that a sink can write many lines at once.
+/// The functions are called while holding the output lock, so a sink need not be thread-safe.
+class Sink {
+public:
+    virtual ~Sink() noexcept = default;
+
+    /// Writes log lines.
+    /// @param data the lines, each terminated with '\n'
+    /// @param size the number of bytes
+    virtual void write(const char* data, size_t size) noexcept = 0;
+
+    /// Writes the lines held in the sink if any.
+    virtual void flush() noexcept {}
+
+    /// Writes the lines held in the sink with async-signal-safe calls only, on a crash signal.
+    /// Called in the signal handler without the output lock.
+    /// @return true if the sink can flush in a signal handler, false if it is skipped
+    virtual bool flush_on_signal() noexcept {return false;}
+};
+
+/// A sink writing to a std::ostream.
+class StreamSink : public Sink {
+private:
+    std::ostream& _stream;
+
+public:
+    /// @param stream the output stream (must outlive the sink)
+    explicit StreamSink(std::ostream& stream) noexcept : _stream(stream) {}
+
+    void write(const char* data, size_t size) noexcept override {
+        _stream.write(data, (std::streamsize)size);
+    }
+
+    void flush() noexcept override {
+        _stream.flush();
+    }
+};
+
+/// Writes bytes to a file descriptor (async-signal-safe).
+/// @param descriptor the file descriptor
+/// @param data the bytes
+/// @param size the number of the bytes
+inline void _write_to_descriptor(int descriptor, const char* data, size_t size) noexcept {
+    while (size > 0 && descriptor >= 0) {
+    #if defined _WIN32
+        const auto written = ::_write(descriptor, data, (unsigned int)size);
+    #else
+        const auto written = ::write(descriptor, data, size);
+    #endif
+        if (written <= 0)
+            break;
+        data += written;
+        size -= (size_t)written;
+    }
+}
+
+/// A sink writing to a file descriptor through a buffer.
+/// Lines are written with a single system call when the buffer is full or flushed.
+class FileSink : public Sink {
+private:
+    int         _descriptor;
+    bool        _owned;
+    size_t      _buffer_size;
+    std::string _buffer;
+
+public:
+    FileSink(FileSink const&) = delete;
+
+    /// Writes to a file descriptor which is not closed by the sink.
+    /// @param descriptor the file descriptor (e.g. 2 for the standard error)
+    /// @param buffer_size the size of the buffer
+    explicit FileSink(int descriptor, size_t buffer_size = DEBUGTRACE_FILE_SINK_BUFFER_SIZE) noexcept
+        : _descriptor(descriptor), _owned(false), _buffer_size(buffer_size) {
+        _buffer.reserve(buffer_size);
+    }
+
+    /// Opens a file to which the lines are appended.
+    /// @param path the path of the file
+    /// @param buffer_size the size of the buffer
+    explicit FileSink(const char* path, size_t buffer_size = DEBUGTRACE_FILE_SINK_BUFFER_SIZE) noexcept
+        : _owned(true), _buffer_size(buffer_size) {
+    #if defined _WIN32
+        _descriptor = ::_open(path, _O_WRONLY | _O_CREAT | _O_APPEND | _O_BINARY, 0644);
+    #else
+        _descriptor = ::open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    #endif
+        _buffer.reserve(buffer_size);
+    }
+
+    ~FileSink() noexcept override {
+        flush();
+        if (_owned && _descriptor >= 0) {
+        #if defined _WIN32
+            ::_close(_descriptor);
+        #else
+            ::close(_descriptor);
+        #endif
+        }
+    }
+
+    /// Returns true if the file is open.
+    bool is_open() const noexcept {return _descriptor >= 0;}
+
+    void write(const char* data, size_t size) noexcept override {
+        if (_buffer.size() + size > _buffer_size)
+            flush();
+        if (size >= _buffer_size)
+            _write_to_descriptor(_descriptor, data, size);
+        else
+            _buffer.append(data, size);
+    }
+
+    void flush() noexcept override {
+        _write_to_descriptor(_descriptor, _buffer.data(), _buffer.size());
+        _buffer.clear();
+    }
+
+    /// Writes the buffer with write(2) only. The buffer is never reallocated since it is reserved,
+    /// but lines being written by other threads at the same time may be broken.
+    bool flush_on_signal() noexcept override {
+        flush();
+        return true;
+    }
+};
+
+/// A sink passing the lines to a function.
+class CallbackSink : public Sink {
+private:
+    std::function<void(const char*, size_t)> _callback;
+
+public:
+    /// @param callback the function called with the lines and the number of bytes
+    explicit CallbackSink(std::function<void(const char*, size_t)> callback) noexcept
+        : _callback(std::move(callback)) {}
+
+    void write(const char* data, size_t size) noexcept override {
+        _callback(data, size);
+    }
+};
+
+/// A sink keeping the lines in memory, for tests.
+class MemorySink : public Sink {
+private:
+    mutable std::mutex _mutex;
+    std::string        _contents;
+
+public:
+    void write(const char* data, size_t size) noexcept override {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _contents.append(data, size);
+    }
+
+    /// Returns the lines written so far.
+    std::string contents() const noexcept {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _contents;
+    }
+
+    /// Discards the lines written so far.
+    void clear() noexcept {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _contents.clear();
+    }
+};
+
+/// A buffer to which string representations of values are appended by to_buffer.
+/// Line breaks are made only by new_line and insert_new_line and their positions are recorded,
+/// so a value containing '\n' is not split into lines.
+class Buffer {
+private:
+    std::string         _string;          // the appended string
+    std::vector<size_t> _line_starts;     // the positions where the second and subsequent lines start
+    int                 _nest_level = 0;  // the nest level of the data
+
+public:
+    /// Returns the appended string.
+    const std::string& string() const noexcept {return _string;}
+
+    /// Returns the size of the appended string.
+    size_t size() const noexcept {return _string.size();}
+
+    /// Returns the number of the lines.
+    size_t line_count() const noexcept {return _line_starts.size() + 1;}
+
+    /// Clears the buffer keeping the capacity.
+    void clear() noexcept {
+        _string.clear();
+        _line_starts.clear();
+        _nest_level = 0;
+    }
+
+    Buffer& operator +=(char c) noexcept {_string += c; return *this;}
+    Buffer& operator +=(const char* string) noexcept {_string += string; return *this;}
+    Buffer& operator +=(const std::string& string) noexcept {_string += string; return *this;}
+
+    /// Appends characters.
+    /// @param string the characters to append
+    /// @param length the number of the characters
+    Buffer& append(const char* string, size_t length) noexcept {_string.append(string, length); return *this;}
+
+    /// Increases the nest level of the data.
+    void up_nest() noexcept {++_nest_level;}
+
+    /// Decreases the nest level of the data.
+    void down_nest() noexcept {--_nest_level;}
+
+    /// Returns the nest level of the data.
+    int nest_level() const noexcept {return _nest_level;}
+
+    /// Returns true if the string has reached maximum_data_output_size,
+    /// after which no more elements are appended.
+    bool is_full() const noexcept;
+
+    /// Starts a new line indented by the nest level.
+    void new_line() noexcept;
+
+    /// Inserts a line break indented by the nest level.
+    /// @param position the position at which the line break is inserted
+    void insert_new_line(size_t position) noexcept;
+
+    /// Joins the lines started after the position into one line.
+    /// Each line break and the indent of the current nest level following it are replaced with the separator,
+    /// except a line break at the position which is removed.
+    /// @param position the position after which the lines are joined
+    /// @param separator the string replacing the line breaks (not longer than a line break and an indent)
+    void join_lines(size_t position, const char* separator) noexcept;
+
+    /// Discards the string after the position.
+    /// @param position the new size of the string
+    void truncate(size_t position) noexcept {
+        _string.resize(position);
+        while (!_line_starts.empty() && _line_starts.back() > position)
+            _line_starts.pop_back();
+    }
+
+    /// Returns the start position of the line containing the position.
+    /// @param position a position in the string
+    size_t line_start_of(size_t position) const noexcept {
+        const auto iterator = std::upper_bound(_line_starts.begin(), _line_starts.end(), position);
+        return iterator == _line_starts.begin() ? 0 : *(iterator - 1);
+    }
+
+    /// Returns the end position (excluding the line break) of the line containing the position.
+    /// @param position a position in the string
+    size_t line_end_of(size_t position) const noexcept {
+        const auto iterator = std::upper_bound(_line_starts.begin(), _line_starts.end(), position);
+        return iterator == _line_starts.end() ? _string.size() : *iterator - 1;
+    }
+
+    /// Returns the start position of the line.
+    /// @param index the index of the line
+    size_t line_start(size_t index) const noexcept {return index == 0 ? 0 : _line_starts[index - 1];}
+
+    /// Returns the end position (excluding the line break) of the line.
+    /// @param index the index of the line
+    size_t line_end(size_t index) const noexcept {
+        return index < _line_starts.size() ? _line_starts[index] - 1 : _string.size();
+    }
+
+    /// Returns the lines.
+    std::vector<std::string> lines() const {
+        std::vector<std::string> lines;
+        lines.reserve(line_count());
+        for (size_t index = 0; index < line_count(); ++index)
+            lines.emplace_back(_string, line_start(index), line_end(index) - line_start(index));
+        return lines;
+    }
+};
+
+struct _CallSite;
+
+/// The number of the buckets of a latency histogram.
+/// Values under 8 nanoseconds have a bucket each, and each power of 2 above is divided into 8 buckets.
+constexpr size_t _histogram_size = 488;
+
+/// The profile of a call site of DEBUGTRACE_ENTER.
+struct _ProfileStats {
+    const _CallSite*    site      = nullptr; // the call site
+    unsigned long long  count     = 0;       // the number of calls
+    long long           inclusive = 0;       // the total time including the called functions in nanoseconds
+    long long           exclusive = 0;       // the total time excluding the called functions in nanoseconds
+    long long           minimum   = 0;       // the minimum time of a call in nanoseconds
+    long long           maximum   = 0;       // the maximum time of a call in nanoseconds
+    std::array<unsigned long long, _histogram_size> histogram {}; // the numbers of calls by time
+};
+
+/// A function being profiled in a thread.
+struct _ProfileFrame {
+    const _CallSite* site;       // the call site
+    long long        start;      // the time of the steady clock when entered in nanoseconds
+    long long        child_time; // the total time of the called functions in nanoseconds
+};
+
+/// A record of the flight recorder.
+struct _FlightRecord {
+    long long        timestamp;    // the time in nanoseconds since the epoch
+    const _CallSite* site;         // the call site
+    size_t           length;       // the length of the text before truncation
+    int              nest_level;   // the nest level of the code
+    char             type;         // 'E': enter, 'L': leave, 'V': value, 'M': message
+    bool             blank_before; // true if an empty line precedes the record
+    char             text[DEBUGTRACE_FLIGHT_RECORD_TEXT_SIZE]; // the value or the message (truncated)
+};
+
+/// The ring buffer of the flight recorder of a thread.
+/// Rings are never freed so that a signal handler can read them,
+/// and a ring released by an exited thread may be reused by another thread.
+struct _FlightRing {
+    std::unique_ptr<_FlightRecord[]> records;  // the records
+    size_t                    capacity;        // the number of the records
+    std::atomic<unsigned long long> count {0}; // the number of the records added so far
+    std::atomic<bool>         in_use {true};   // true while used by a thread
+    _FlightRing*              next = nullptr;  // the next ring in _flight_rings
+    char                      thread_tag[64];  // the thread tag (e.g. "[1] ")
+    size_t                    thread_tag_length = 0;
+};
+
+/// The position of dump_flight_recorder in a ring.
+struct _FlightCursor {
+    const _FlightRing*  ring;
+    unsigned long long  position; // the count of the next record
+    unsigned long long  end;      // the count of the records when the dump started
+};
+
+/// The cursors of dump_flight_recorder, one for each ring.
+/// They are allocated before a ring is added so that a signal handler does not allocate them,
+/// and never freed since a signal handler may be using them.
+struct _FlightCursors {
+    size_t                           capacity; // the number of the cursors
+    std::unique_ptr<_FlightCursor[]> cursors;  // the cursors
+};
+
+/// A pattern of the call site filter.
+struct _FilterPattern {
+    bool        include; // true: the call sites matching the pattern are traced, false: they are not traced
+    bool        file;    // true: matches the source file name, false: matches the function name
+    std::string glob;    // the pattern ('*': any characters, '?': any character)
+};
+
+/// A snapshot of the settings of the configuration file and the call site filter.
+/// A snapshot is built completely, published to _configuration with a single store and never modified after that,
+/// so that other threads read either all old or all new settings without a lock.
+/// The previous snapshot is freed when no thread reads it (see _ConfigurationReader and _RetiredConfiguration).
+struct _Configuration {
+    std::vector<_FilterPattern> filter_patterns;                       // the patterns of the call site filter
+    std::string                 sink_name;                             // the sink set by the file
+    size_t                      collection_limit              = 0;     // replaces collection_limit if set
+    size_t                      maximum_data_output_width     = 0;     // replaces maximum_data_output_width if set
+    double                      sampling_factor               = 1.0;   // multiplies the calls output by the samplers
+    bool                        collection_limit_set          = false; // true if collection_limit is set
+    bool                        maximum_data_output_width_set = false; // true if maximum_data_output_width is set
+};
+
+/// The trace state of each thread.
+struct _Context {
+    int          code_nest_level        = 0; // the nest level of the code
+    int          before_code_nest_level = 0; // the nest level of the code before
+    unsigned int thread_number          = 0; // the number of the thread (0: not assigned yet)
+    std::string  thread_name;                // the name of the thread
+    std::string  thread_tag;                 // the tag of the thread (e.g. "[1] ")
+    std::string  log_buffer;                 // the buffer to build a log line
+    size_t       log_buffer_capacity    = 0; // the largest capacity of log_buffer (which is swapped in the asynchronous mode)
+    Buffer       value_buffer;               // the buffer to build the string representation of a value
+    std::time_t  datetime_base   = -1;       // the time (in seconds) resolved by localtime into datetime_tm
+    std::tm      datetime_tm     {};         // the local time of datetime_base
+    std::time_t  datetime_second = -1;       // the time (in seconds) of datetime_string
+    const char*  datetime_format = nullptr;  // the format of datetime_string
+    std::string  datetime_head_format;       // the format up to the seconds ("%S")
+    std::string  datetime_tail_format;       // the format after the seconds
+    std::string  datetime_string;            // the formatted date and time
+    size_t       datetime_fraction_position = 0; // the position in datetime_string where the fraction of a second is inserted
+    std::string  binary_buffer;              // the buffer of binary records not yet written
+    unsigned int binary_generation      = 0; // the binary recording to which binary_buffer belongs
+    bool         binary_thread_name_changed = false; // true if thread_name is to be written to binary_buffer
+    std::string  chrome_buffer;              // the buffer of trace events not yet written
+    unsigned int chrome_generation      = 0; // the Chrome trace to which chrome_buffer belongs
+    uint64_t     random_state           = 0; // the state of the random numbers for sampling (0: not seeded yet)
+    std::vector<_ProfileFrame> profile_stack; // the functions being profiled
+    std::vector<std::unique_ptr<_ProfileStats>> profile_stats; // the profiles indexed by the call site id
+    std::mutex   profile_mutex;              // guards profile_stats against print_profile
+    bool         profile_registered     = false; // true if added to _profile_contexts
+    _FlightRing* flight_ring            = nullptr; // the ring buffer of the flight recorder
+    int          slow_call_depth        = 0; // the nest level of the scopes being captured (0: not capturing)
+    long long    slow_call_start        = 0; // the time of the steady clock when the outermost scope was entered
+    std::string  slow_call_buffer;           // the lines of the outermost scope being captured
+    size_t       slow_call_dropped_lines = 0; // the number of the lines which did not fit in slow_call_buffer
+
+    _Context() = default;
+    _Context(_Context const&) = delete;
+    ~_Context() noexcept;
+    _Context& operator =(const _Context&) = delete;
+};
+
+/// Returns the offset of the file name without the directory in the path.
+/// @param path the path of the source file
+constexpr size_t _get_base_name_offset(const char* path) noexcept {
+    size_t offset = 0;
+    for (size_t index = 0; path[index] != '\0'; ++index) {
+        if (path[index] == '/' || path[index] == '\\')
+            offset = index + 1;
+    }
+    return offset;
+}
+
+/// The static information of the code calling a macro.
+/// An instance is created once per call site as a static local variable,
+/// and the strings output with every call are built when it is created.
+struct _CallSite {
+    const char*   func_name;      // the function name
+    const char*   signature;      // the function signature with the qualified name (e.g. "void net::Socket::poll(int)")
+    const char*   file_name;      // the source file name
+    const char*   base_name;      // the source file name without the directory
+    int           line_number;    // the line number
+    const char*   name;           // the variable name of DEBUGTRACE_PRINT (or nullptr)
+    unsigned char type_id;        // the binary type id of the variable (0: not recorded as raw bytes)
+    unsigned int  id;             // the unique id of this call site
+    std::string   location;       // " (<base_name>: <line_number>)"
+    std::string   leave_location; // " (<base_name>)"
+    std::string   enter_message;  // "Enter <func_name>"
+    std::string   leave_message;  // "Leave <func_name>"
+    std::string   name_prefix;    // "<name> = "
+    std::vector<std::string> name_prefixes; // "<name> = " of each variable of DEBUGTRACE_PRINT with several variables
+    std::atomic<unsigned int> binary_generation {0}; // the binary recording in which this call site was defined
+    long long     slow_call_threshold; // the threshold of a slow call in nanoseconds (negative: slow_call_threshold)
+    std::atomic<unsigned int> filter_state {0}; // (the filter generation << 1) | 1 if selected by the filter (0: not evaluated yet)
+
+    _CallSite() = delete;
+    _CallSite(_CallSite const&) = delete;
+
+    /// Constructs a call site.
+    /// @param func_name the function name
+    /// @param signature the function signature with the qualified name
+    /// @param file_name the source file name
+    /// @param base_name_offset the offset of the file name without the directory
+    /// @param line_number the line number
+    /// @param name the variable name of DEBUGTRACE_PRINT
+    /// @param type_id the binary type id of the variable
+    /// @param name_count the number of the variables of DEBUGTRACE_PRINT
+    /// @param slow_call_threshold the threshold of a slow call in nanoseconds (negative: slow_call_threshold)
+    _CallSite(const char* func_name, const char* signature, const char* file_name, size_t base_name_offset,
+        int line_number, const char* name = nullptr, unsigned char type_id = 0, size_t name_count = 1,
+        long long slow_call_threshold = -1) noexcept;
+
+    _CallSite& operator =(const _CallSite&) = delete;
+};
+
+/// The sampling state of a call site of DEBUGTRACE_ENTER_EVERY, DEBUGTRACE_PRINT_RATE and so on.
+/// An instance is created once per call site as a static local variable.
+/// The number of calls sampled out is output periodically as a summary line.
+class _Sampler {
+public:
+    /// The kinds of sampling.
+    enum class kind {
+        every,       // every n-th call
+        probability, // each call with a probability
+        rate         // up to n calls per second
+    };
+
+private:
+    const kind                      _kind;
+    const double                    _parameter;         // n of every or rate, or the probability
+    std::atomic<unsigned int>       _generation   {0};  // _configuration_generation of _limit and _threshold
+    std::atomic<unsigned long long> _limit        {1};  // n of every or rate multiplied by the sampling factor
+    std::atomic<uint64_t>           _threshold    {0};  // the probability multiplied by the sampling factor, scaled to 2^64
+    std::atomic<unsigned long long> _count        {0};  // the number of calls (every) or calls in the window (rate)
+    std::atomic<long long>          _window       {-1}; // the second of the steady clock counted by _count (rate)
+    std::atomic<unsigned long long> _suppressed   {0};  // the number of calls sampled out since the last summary
+    std::atomic<long long>          _summary_time;      // the time of the steady clock of the last summary in nanoseconds
+
+    /// Outputs the summary of the calls sampled out if sampling_summary_interval has elapsed.
+    void _summarize(_CallSite& site, long long now) noexcept;
+
+    /// Sets _limit and _threshold from the parameter and the sampling factor of the configuration.
+    /// @param generation the generation of the configuration
+    void _configure(unsigned int generation) noexcept;
+
+public:
+    _Sampler() = delete;
+    _Sampler(_Sampler const&) = delete;
+
+    /// Constructs a sampler.
+    /// @param sampling_kind the kind of sampling
+    /// @param parameter n of every or rate, or the probability (0.0 to 1.0)
+    _Sampler(kind sampling_kind, double parameter) noexcept
+        : _kind(sampling_kind), _parameter(parameter),
+          _summary_time((long long)std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count()) {}
+
+    /// Returns true if the call is to be output.
+    /// Calls sampled out are only counted.
+    /// @param site the call site
+    bool sample(_CallSite& site) noexcept;
+
+    _Sampler& operator =(const _Sampler&) = delete;
+};
+
+/// The binary type id of a type whose values are recorded as raw bytes (0: recorded as a text).
+template <typename T> struct _BinaryType                     : std::integral_constant<unsigned char,  0> {};
+template <>           struct _BinaryType<bool>               : std::integral_constant<unsigned char,  1> {};
+template <>           struct _BinaryType<char>               : std::integral_constant<unsigned char,  2> {};
+template <>           struct _BinaryType<signed char>        : std::integral_constant<unsigned char,  3> {};
+template <>           struct _BinaryType<unsigned char>      : std::integral_constant<unsigned char,  4> {};
+template <>           struct _BinaryType<short>              : std::integral_constant<unsigned char,  5> {};
+template <>           struct _BinaryType<unsigned short>     : std::integral_constant<unsigned char,  6> {};
+template <>           struct _BinaryType<int>                : std::integral_constant<unsigned char,  7> {};
+template <>           struct _BinaryType<unsigned int>       : std::integral_constant<unsigned char,  8> {};
+template <>           struct _BinaryType<long>               : std::integral_constant<unsigned char,  9> {};
+template <>           struct _BinaryType<unsigned long>      : std::integral_constant<unsigned char, 10> {};
+template <>           struct _BinaryType<long long>          : std::integral_constant<unsigned char, 11> {};
+template <>           struct _BinaryType<unsigned long long> : std::integral_constant<unsigned char, 12> {};
+template <>           struct _BinaryType<float>              : std::integral_constant<unsigned char, 13> {};
+template <>           struct _BinaryType<double>             : std::integral_constant<unsigned char, 14> {};
+template <>           struct _BinaryType<long double>        : std::integral_constant<unsigned char, 15> {};
+template <>           struct _BinaryType<wchar_t>            : std::integral_constant<unsigned char, 16> {};
+
+/// The binary type id of the variable of DEBUGTRACE_PRINT as the return type (0 for several variables).
+/// Used only in decltype.
+template <typename T>
+std::integral_constant<unsigned char, _BinaryType<typename std::decay<T>::type>::value> _get_binary_type(const T&) noexcept;
+template <typename T1, typename T2, typename... Ts>
+std::integral_constant<unsigned char, 0> _get_binary_type(const T1&, const T2&, const Ts&...) noexcept;
+
+/// The number of the variables of DEBUGTRACE_PRINT as the return type. Used only in decltype.
+template <typename... Ts>
+std::integral_constant<size_t, sizeof...(Ts)> _get_value_count(const Ts&...) noexcept;
+
 #ifdef __cpp_inline_variables
     inline const char* const _start_message            = DEBUGTRACE_START_MESSAGE;
     inline const char*       enter_string              = DEBUGTRACE_ENTER_STRING;
@@ -117,13 +859,69 @@ namespace debugtrace {
     inline const char*       varname_value_separator   = DEBUGTRACE_VARNAME_VALUE_SEPARATOR;
     inline const char*       pair_separator            = DEBUGTRACE_PAIR_SEPARATOR;
     inline const char*       log_datetime_format       = DEBUGTRACE_LOG_DATETIME_FORMAT;
+    inline int               log_datetime_precision    = DEBUGTRACE_LOG_DATETIME_PRECISION;
     inline size_t            maximum_data_output_width = DEBUGTRACE_MAXIMUM_DATA_OUTPUT_WIDTH;
     inline size_t            collection_limit          = DEBUGTRACE_COLLECTION_LIMIT;
-    inline bool              _initialized              = false;
-    inline std::ostream&     output_stream             = std::cerr;
-    inline int               _code_nest_level          = 0;
-    inline int               _before_code_nest_level   = 0;
-    inline int               _data_nest_level          = 0;
+    inline size_t            collection_tail_limit     = DEBUGTRACE_COLLECTION_TAIL_LIMIT;
+    inline size_t            string_limit              = DEBUGTRACE_STRING_LIMIT;
+    inline size_t            maximum_data_output_size  = DEBUGTRACE_MAXIMUM_DATA_OUTPUT_SIZE;
+    inline int               maximum_data_nest_level   = DEBUGTRACE_MAXIMUM_DATA_NEST_LEVEL;
+    inline bool              thread_tag_enabled        = DEBUGTRACE_THREAD_TAG_ENABLED;
+    inline bool              print_location_enabled    = DEBUGTRACE_PRINT_LOCATION_ENABLED;
+    inline std::atomic<unsigned int> _trace_mask               {(DEBUGTRACE_START_ENABLED ? _master_switch : 0u) | DEBUGTRACE_START_CATEGORIES};
+    inline int               sampling_summary_interval = DEBUGTRACE_SAMPLING_SUMMARY_INTERVAL;
+    inline std::atomic<bool> _initialized              {false};
+    inline std::shared_ptr<Sink> _sink                 {std::make_shared<StreamSink>(std::cerr)};
+    inline std::mutex        _output_mutex;
+    inline std::atomic<unsigned int> _thread_count     {0};
+    inline size_t            async_queue_capacity      = DEBUGTRACE_ASYNC_QUEUE_CAPACITY;
+    inline overflow_policy   async_overflow_policy     = DEBUGTRACE_ASYNC_OVERFLOW_POLICY;
+    inline size_t            async_batch_size          = DEBUGTRACE_ASYNC_BATCH_SIZE;
+    inline flush_policy      sink_flush_policy         = DEBUGTRACE_FLUSH_POLICY;
+    inline size_t            flush_bytes               = DEBUGTRACE_FLUSH_BYTES;
+    inline int               flush_interval            = DEBUGTRACE_FLUSH_INTERVAL;
+    inline bool              flush_on_fatal_signal     = DEBUGTRACE_FLUSH_ON_FATAL_SIGNAL;
+    inline size_t            _unflushed_bytes          = 0;
+    inline std::atomic<_FlushTimer*> _flush_timer              {nullptr};
+    inline std::atomic<_AsyncWriter*> _async_writer             {nullptr};
+    inline std::atomic<unsigned int> _call_site_count          {0};
+    inline size_t            binary_buffer_size        = DEBUGTRACE_BINARY_BUFFER_SIZE;
+    inline std::atomic<bool> _binary_recording         {false};
+    inline std::atomic<unsigned int> _binary_generation        {0};
+    inline std::FILE*        _binary_file              = nullptr;
+    inline std::mutex        _binary_mutex;
+    inline std::atomic<bool> _profiling                {false};
+    inline std::mutex        _profile_mutex;
+    inline std::vector<_Context*> _profile_contexts;
+    inline std::vector<std::unique_ptr<_ProfileStats>> _profile_totals;
+    inline size_t            chrome_buffer_size        = DEBUGTRACE_CHROME_BUFFER_SIZE;
+    inline std::atomic<bool> _chrome_tracing           {false};
+    inline std::atomic<unsigned int> _chrome_generation        {0};
+    inline std::FILE*        _chrome_file              = nullptr;
+    inline std::mutex        _chrome_mutex;
+    inline size_t            flight_recorder_capacity  = DEBUGTRACE_FLIGHT_RECORDER_CAPACITY;
+    inline int               flight_recorder_descriptor = DEBUGTRACE_FLIGHT_RECORDER_DESCRIPTOR;
+    inline std::atomic<bool> _flight_recording         {false};
+    inline std::atomic<bool> _flight_crash_dumped      {false};
+    inline std::atomic<_FlightRing*> _flight_rings             {nullptr};
+    inline std::atomic<_FlightCursors*> _flight_cursors           {nullptr};
+    inline std::mutex        _flight_ring_mutex;
+    inline std::atomic<bool> _flight_dumping           {false};
+    inline long              _flight_utc_offset        = 0;
+    inline std::array<char, 8> _flight_zone              {};
+    inline long long         slow_call_threshold       = DEBUGTRACE_SLOW_CALL_THRESHOLD;
+    inline size_t            slow_call_buffer_size     = DEBUGTRACE_SLOW_CALL_BUFFER_SIZE;
+    inline std::atomic<bool> _slow_call_capture        {false};
+    inline std::atomic<unsigned int> _filter_generation        {1};
+    inline int               configuration_check_interval = DEBUGTRACE_CONFIGURATION_CHECK_INTERVAL;
+    inline std::atomic<const _Configuration*> _configuration            {nullptr};
+    inline std::mutex        _configuration_mutex;
+    inline std::atomic<unsigned int> _configuration_generation {1};
+    inline std::atomic<unsigned int> _configuration_readers[2];
+    inline std::atomic<size_t> _configured_collection_limit {SIZE_MAX};
+    inline std::atomic<size_t> _configured_maximum_data_output_width {SIZE_MAX};
+    inline std::atomic<_ConfigurationWatcher*> _configuration_watcher    {nullptr};
+    inline thread_local _Context _context;
     inline unsigned int      _code_page                = 65001; // UTF-8
 #else
     extern const char* const _start_message;
@@ -138,764 +936,4117 @@ namespace debugtrace {
     extern const char*       varname_value_separator;
     extern const char*       pair_separator;
     extern const char*       log_datetime_format;
+    extern int               log_datetime_precision;
     extern size_t            maximum_data_output_width;
     extern size_t            collection_limit;
-    extern bool              _initialized;
-    extern std::ostream&     output_stream;
-    extern int               _code_nest_level;
-    extern int               _before_code_nest_level;
-    extern int               _data_nest_level;
+    extern size_t            collection_tail_limit;
+    extern size_t            string_limit;
+    extern size_t            maximum_data_output_size;
+    extern int               maximum_data_nest_level;
+    extern bool              thread_tag_enabled;
+    extern bool              print_location_enabled;
+    extern std::atomic<unsigned int> _trace_mask;
+    extern int               sampling_summary_interval;
+    extern std::atomic<bool> _initialized;
+    extern std::shared_ptr<Sink> _sink;
+    extern std::mutex        _output_mutex;
+    extern std::atomic<unsigned int> _thread_count;
+    extern size_t            async_queue_capacity;
+    extern overflow_policy   async_overflow_policy;
+    extern size_t            async_batch_size;
+    extern flush_policy      sink_flush_policy;
+    extern size_t            flush_bytes;
+    extern int               flush_interval;
+    extern bool              flush_on_fatal_signal;
+    extern size_t            _unflushed_bytes;
+    extern std::atomic<_FlushTimer*> _flush_timer;
+    extern std::atomic<_AsyncWriter*> _async_writer;
+    extern std::atomic<unsigned int> _call_site_count;
+    extern size_t            binary_buffer_size;
+    extern std::atomic<bool> _binary_recording;
+    extern std::atomic<unsigned int> _binary_generation;
+    extern std::FILE*        _binary_file;
+    extern std::mutex        _binary_mutex;
+    extern std::atomic<bool> _profiling;
+    extern std::mutex        _profile_mutex;
+    extern std::vector<_Context*> _profile_contexts;
+    extern std::vector<std::unique_ptr<_ProfileStats>> _profile_totals;
+    extern size_t            chrome_buffer_size;
+    extern std::atomic<bool> _chrome_tracing;
+    extern std::atomic<unsigned int> _chrome_generation;
+    extern std::FILE*        _chrome_file;
+    extern std::mutex        _chrome_mutex;
+    extern size_t            flight_recorder_capacity;
+    extern int               flight_recorder_descriptor;
+    extern std::atomic<bool> _flight_recording;
+    extern std::atomic<bool> _flight_crash_dumped;
+    extern std::atomic<_FlightRing*> _flight_rings;
+    extern std::atomic<_FlightCursors*> _flight_cursors;
+    extern std::mutex        _flight_ring_mutex;
+    extern std::atomic<bool> _flight_dumping;
+    extern long              _flight_utc_offset;
+    extern std::array<char, 8> _flight_zone;
+    extern long long         slow_call_threshold;
+    extern size_t            slow_call_buffer_size;
+    extern std::atomic<bool> _slow_call_capture;
+    extern std::atomic<unsigned int> _filter_generation;
+    extern int               configuration_check_interval;
+    extern std::atomic<const _Configuration*> _configuration;
+    extern std::mutex        _configuration_mutex;
+    extern std::atomic<unsigned int> _configuration_generation;
+    extern std::atomic<unsigned int> _configuration_readers[2];
+    extern std::atomic<size_t> _configured_collection_limit;
+    extern std::atomic<size_t> _configured_maximum_data_output_width;
+    extern std::atomic<_ConfigurationWatcher*> _configuration_watcher;
+    extern thread_local _Context _context;
     extern unsigned int      _code_page;
 #endif // __cpp_inline_variables
 
-/// Returns a string for code indent.
-inline std::string _get_code_indent_string() noexcept {
-    std::string indent_str;
-    for (auto index = 0; index < _code_nest_level && index < maximum_indents; ++index)
-        indent_str += code_indent_string;
-    return indent_str;
+/// Returns true if tracing of the categories is enabled.
+/// This is checked by the macros before anything else, so it costs only a relaxed load and a branch.
+/// @param categories the categories (e.g. category::print)
+inline bool _is_enabled(unsigned int categories) noexcept {
+    const auto mask = _master_switch | categories;
+    return (_trace_mask.load(std::memory_order_relaxed) & mask) == mask;
 }
 
-/// Returns a string for data indent.
-inline std::string _get_data_indent_string() noexcept {
-    std::string indent_str;
-    for (auto index = 0; index < _data_nest_level && index < maximum_indents; ++index)
-        indent_str += data_indent_string;
-    return indent_str;
-}
+/// Holds the current snapshot of the configuration while reading it, so that it is not freed.
+/// A reader is counted in the slot of _configuration_readers selected by _configuration_generation,
+/// so that a thread publishing a new snapshot waits only for the readers counted before it,
+/// while new readers are counted in the other slot.
+/// A reader must not block, since a thread publishing a new snapshot waits for the readers.
+class _ConfigurationReader {
+private:
+    const _Configuration* _snapshot;
+    unsigned int _slot;
 
-/// Outputs the date and time.
-inline std::string _get_log_datetime() noexcept {
-    const auto now = std::time(nullptr);
-#ifdef _MSC_VER
-    // Visual C++
-    struct std::tm datetime;
-    localtime_s(&datetime, &now);
-#else
-    // Others
-    const auto datetime = *std::localtime(&now);
-#endif // _MSC_VER
-    char buff[64];
-    std::strftime(buff, sizeof(buff), log_datetime_format, &datetime);
-    return buff;
-}
+public:
+    _ConfigurationReader(_ConfigurationReader const&) = delete;
 
-/// Sets Windwos Code Page
-/// @param codePage the code page (e.g.: CP_ACP, CP_UTF8)
-inline void set_code_page(unsigned int codePage) {
-    _code_page = codePage;
-}
+    _ConfigurationReader() noexcept {
+        for (;;) {
+            const auto generation = _configuration_generation.load(std::memory_order_seq_cst);
+            _slot = generation & 1;
+            _configuration_readers[_slot].fetch_add(1, std::memory_order_seq_cst);
+            // counted before the generation changes, or counted again in the other slot
+            if (_configuration_generation.load(std::memory_order_seq_cst) == generation)
+                break;
+            _configuration_readers[_slot].fetch_sub(1, std::memory_order_release);
+        }
+        _snapshot = _configuration.load(std::memory_order_seq_cst);
+    }
 
-/// Returns a string representation of the type of the value.
-/// @param value the value to output
-template <typename T>
-std::string _get_type_string(const T& value, size_t size = -1) noexcept {
-    auto type_string = std::string("(");
-#ifdef _MSC_VER
-    // Visual C++
-    type_string += typeid(value).name();
-#else
-    // gcc, clang
-    int status;
-    char* type_name = abi::__cxa_demangle(typeid(value).name(), nullptr, nullptr, &status);
-    type_string += (type_name == nullptr ? "?" : type_name);
-    if (type_name != nullptr)
-        free(type_name);
-#endif // _MSC_VER
-    if ((int)size != -1) {
-        type_string += " size:";
-        type_string += std::to_string(size);
+    ~_ConfigurationReader() noexcept {
+        _configuration_readers[_slot].fetch_sub(1, std::memory_order_release);
     }
-    type_string += ')';
-    return type_string;
-}
 
-/// Returns a string representation of the value.
-/// @param value the value to output
-inline std::vector<std::string> to_strings(const bool& value) noexcept {
-    return std::vector<std::string>({value ? "true" : "false"});
-}
+    /// Returns the snapshot, or nullptr if none has been published.
+    const _Configuration* get() const noexcept {return _snapshot;}
 
-/// Returns a string representation of the value.
-/// @param value the value to output
-inline std::vector<std::string> to_strings(const char& value) noexcept {
-    return std::vector<std::string>({"(char)" + std::to_string(value)});
-}
+    _ConfigurationReader& operator =(const _ConfigurationReader&) = delete;
+};
 
-/// Returns a string representation of the value.
-/// @param value the value to output
-inline std::vector<std::string> to_strings(const signed char& value) noexcept {
-    return std::vector<std::string>({"(signed char)" + std::to_string(value)});
-}
+/// A snapshot of the configuration replaced by a new one,
+/// which is freed after the threads reading it are done when this is destroyed.
+/// The waiting must not be done while holding _output_mutex, since it would stop the output meanwhile.
+class _RetiredConfiguration {
+private:
+    const _Configuration* _snapshot = nullptr;
+    unsigned int _slot = 0; // the slot of _configuration_readers of the threads which may read the snapshot
 
-/// Returns a string representation of the value.
-/// @param value the value to output
-inline std::vector<std::string> to_strings(const unsigned char& value) noexcept {
-    return std::vector<std::string>({"(unsigned char)" + std::to_string(value)});
-}
+public:
+    _RetiredConfiguration() noexcept = default;
+    _RetiredConfiguration(_RetiredConfiguration const&) = delete;
 
-/// Returns a string representation of the value.
-/// @param value the value to output
-inline std::vector<std::string> to_strings(const short& value) noexcept {
-    return std::vector<std::string>({"(short)" + std::to_string(value)});
-}
+    _RetiredConfiguration(const _Configuration* snapshot, unsigned int slot) noexcept
+        : _snapshot(snapshot), _slot(slot) {}
 
-/// Returns a string representation of the value.
-/// @param value the value to output
-inline std::vector<std::string> to_strings(const unsigned short& value) noexcept {
-    return std::vector<std::string>({"(unsigned short)" + std::to_string(value)});
-}
+    _RetiredConfiguration(_RetiredConfiguration&& other) noexcept
+        : _snapshot(other._snapshot), _slot(other._slot) {
+        other._snapshot = nullptr;
+    }
 
-/// Returns a string representation of the value.
-/// @param value the value to output
-inline std::vector<std::string> to_strings(const int& value) noexcept {
-    return std::vector<std::string>({std::to_string(value)});
-}
+    ~_RetiredConfiguration() noexcept {
+        if (_snapshot == nullptr)
+            return;
+        while (_configuration_readers[_slot].load(std::memory_order_seq_cst) != 0)
+            std::this_thread::yield();
+        delete _snapshot;
+    }
 
-/// Returns a string representation of the value.
-/// @param value the value to output
-inline std::vector<std::string> to_strings(const unsigned int& value) noexcept {
-    return std::vector<std::string>({std::to_string(value) + 'u'});
+    _RetiredConfiguration& operator =(const _RetiredConfiguration&) = delete;
+
+    _RetiredConfiguration& operator =(_RetiredConfiguration&& other) noexcept {
+        std::swap(_snapshot, other._snapshot);
+        std::swap(_slot, other._slot);
+        return *this;
+    }
+};
+
+/// Returns a copy of the current snapshot of the configuration to be modified and published.
+/// Called while holding _configuration_mutex.
+inline std::unique_ptr<_Configuration> _copy_configuration() noexcept {
+    const auto current = _configuration.load(std::memory_order_relaxed);
+    return std::unique_ptr<_Configuration>(current != nullptr ? new _Configuration(*current) : new _Configuration());
 }
 
-/// Returns a string representation of the value.
-/// @param value the value to output
-inline std::vector<std::string> to_strings(const long& value) noexcept {
-    return std::vector<std::string>({std::to_string(value) + 'l'});
+/// Publishes a snapshot of the configuration and returns the previous one,
+/// which is freed when the returned object is destroyed.
+/// Called while holding _configuration_mutex, which must be held until then.
+/// @param configuration the snapshot
+/// @param filter_changed true if the patterns of the call site filter are changed
+inline _RetiredConfiguration _publish_configuration(std::unique_ptr<_Configuration> configuration,
+        bool filter_changed) noexcept {
+    // the limits are read on every output of a container, so they are also published without a snapshot
+    _configured_collection_limit.store(configuration->collection_limit_set
+        ? std::min(configuration->collection_limit, SIZE_MAX - 1) : SIZE_MAX, std::memory_order_relaxed);
+    _configured_maximum_data_output_width.store(configuration->maximum_data_output_width_set
+        ? std::min(configuration->maximum_data_output_width, SIZE_MAX - 1) : SIZE_MAX, std::memory_order_relaxed);
+    const auto previous = _configuration.exchange(configuration.release(), std::memory_order_seq_cst);
+    if (filter_changed)
+        _filter_generation.fetch_add(1, std::memory_order_release);
+    // a reader counted in the other slot after this reads the new snapshot
+    const auto generation = _configuration_generation.fetch_add(1, std::memory_order_seq_cst);
+    return _RetiredConfiguration(previous, generation & 1);
 }
 
-/// Returns a string representation of the value.
-/// @param value the value to output
-inline std::vector<std::string> to_strings(const unsigned long& value) noexcept {
-    return std::vector<std::string>({std::to_string(value) + "ul"});
+/// Returns collection_limit, or the value of the configuration file if it set one.
+inline size_t _get_collection_limit() noexcept {
+    const auto limit = _configured_collection_limit.load(std::memory_order_relaxed);
+    return limit != SIZE_MAX ? limit : collection_limit;
 }
 
-/// Returns a string representation of the value.
-/// @param value the value to output
-inline std::vector<std::string> to_strings(const long long& value) noexcept {
-    return std::vector<std::string>({std::to_string(value) + "ll"});
+/// Returns maximum_data_output_width, or the value of the configuration file if it set one.
+inline size_t _get_maximum_data_output_width() noexcept {
+    const auto width = _configured_maximum_data_output_width.load(std::memory_order_relaxed);
+    return width != SIZE_MAX ? width : maximum_data_output_width;
 }
 
-/// Returns a string representation of the value.
-/// @param value the value to output
-inline std::vector<std::string> to_strings(const unsigned long long& value) noexcept {
-    return std::vector<std::string>({std::to_string(value) + "ull"});
+/// Enables tracing of the categories enabled by enable_categories.
+inline void enable() noexcept {
+    _trace_mask.fetch_or(_master_switch, std::memory_order_relaxed);
 }
 
-/// Returns a string representation of the value.
-/// @param value the value to output
-inline std::vector<std::string> to_strings(const float& value) noexcept {
-    return std::vector<std::string>({std::to_string(value) + 'f'});
+/// Disables tracing of all categories.
+inline void disable() noexcept {
+    _trace_mask.fetch_and(~_master_switch, std::memory_order_relaxed);
 }
 
-/// Returns a string representation of the value.
-/// @param value the value to output
-inline std::vector<std::string> to_strings(const double& value) noexcept {
-    return std::vector<std::string>({std::to_string(value)});
+/// Returns true if tracing is enabled.
+inline bool is_enabled() noexcept {
+    return (_trace_mask.load(std::memory_order_relaxed) & _master_switch) != 0;
 }
 
-/// Returns a string representation of the value.
-/// @param value the value to output
-inline std::vector<std::string> to_strings(const long double& value) noexcept {
-    return std::vector<std::string>({std::to_string(value) + 'l'});
+/// Enables tracing of the categories.
+/// @param categories the categories (e.g. category::enter | category::message)
+inline void enable_categories(unsigned int categories) noexcept {
+    _trace_mask.fetch_or(categories & category::all, std::memory_order_relaxed);
 }
 
-/// Returns a string representation of the value.
-/// @param value the value to output
-inline std::vector<std::string> to_strings(const wchar_t& value) noexcept {
-    return std::vector<std::string>({"(wchar_t)" + std::to_string(value)});
+/// Disables tracing of the categories.
+/// @param categories the categories (e.g. category::print)
+inline void disable_categories(unsigned int categories) noexcept {
+    _trace_mask.fetch_and(~(categories & category::all), std::memory_order_relaxed);
 }
 
-/// Returns a string representation of the value.
-/// @param value the value to output
-inline std::vector<std::string> to_strings(char* const& value) noexcept {
-    return std::vector<std::string>({value == nullptr
-        ? "(char*)nullptr})"
-        : "(char*)\"" + std::string(value) + '"'
-    });
+/// Appends a string for code indent.
+/// @param string the string to which the indent is appended
+inline void _append_code_indent_string(std::string& string) noexcept {
+    for (auto index = 0; index < _context.code_nest_level && index < maximum_indents; ++index)
+        string += code_indent_string;
 }
 
-/// Returns a string representation of the value.
-/// @param value the value to output
-inline std::vector<std::string> to_strings(const char* const& value) noexcept {
-    return std::vector<std::string>({value == nullptr
-        ? "(const char*)nullptr"
-        : "(const char*)\"" + std::string(value) + '"'
-    });
+inline bool Buffer::is_full() const noexcept {
+    return _string.size() >= maximum_data_output_size;
 }
 
+inline void Buffer::new_line() noexcept {
+    _string += '\n';
+    _line_starts.push_back(_string.size());
+    for (auto index = 0; index < _nest_level && index < maximum_indents; ++index)
+        _string += data_indent_string;
+}
 
-/// Returns a string representation of the value.
-/// @param value the value to output
-inline std::vector<std::string> to_strings(signed char* const& value) noexcept {
-    return std::vector<std::string>({value == nullptr
-        ? "(signed char*)nullptr"
-        : "(signed char*)\"" + std::string((char*)value) + '"'
-    });
+inline void Buffer::join_lines(size_t position, const char* separator) noexcept {
+    const auto first = std::upper_bound(_line_starts.begin(), _line_starts.end(), position);
+    if (first == _line_starts.end())
+        return;
+    const auto indent_length = (size_t)std::min(_nest_level, maximum_indents) * std::strlen(data_indent_string);
+    const auto separator_length = std::strlen(separator);
+    auto to = *first - 1;
+    for (auto iterator = first; iterator != _line_starts.end(); ++iterator) {
+        if (*iterator - 1 != position) {
+            std::memcpy(&_string[to], separator, separator_length);
+            to += separator_length;
+        }
+        const auto from = *iterator + indent_length;
+        const auto end = iterator + 1 == _line_starts.end() ? _string.size() : *(iterator + 1) - 1;
+        std::memmove(&_string[to], &_string[from], end - from);
+        to += end - from;
+    }
+    _string.resize(to);
+    _line_starts.erase(first, _line_starts.end());
 }
 
-/// Returns a string representation of the value.
-/// @param value the value to output
-inline std::vector<std::string> to_strings(const signed char* const& value) noexcept {
-    return std::vector<std::string>({value == nullptr
-        ?"(const signed char*)nullptr"
-        :"(const signed char*)\"" + std::string((const char*)value) + '"'
-    });
+inline void Buffer::insert_new_line(size_t position) noexcept {
+    std::string line_break(1, '\n');
+    for (auto index = 0; index < _nest_level && index < maximum_indents; ++index)
+        line_break += data_indent_string;
+    _string.insert(position, line_break);
+    for (auto& line_start : _line_starts) {
+        if (line_start > position)
+            line_start += line_break.size();
+    }
+    _line_starts.insert(std::upper_bound(_line_starts.begin(), _line_starts.end(), position), position + 1);
 }
 
-/// Returns a string representation of the value.
-/// @param value the value to output
-inline std::vector<std::string> to_strings(unsigned char* const& value) noexcept {
-    return std::vector<std::string>({value == nullptr
-        ? "(unsigned char*)nullptr"
-        : "(unsigned char*)\"" + std::string((char *)value) + '"'
-    });
+/// Returns the number of the current thread.
+inline unsigned int _get_thread_number() noexcept {
+    if (_context.thread_number == 0)
+        _context.thread_number = ++_thread_count;
+    return _context.thread_number;
 }
 
-/// Returns a string representation of the value.
-/// @param value the value to output
-inline std::vector<std::string> to_strings(const unsigned char* const& value) noexcept {
-    return std::vector<std::string>({value == nullptr
-        ? "(const unsigned char*)nullptr"
-        : "(const unsigned char*)\"" + std::string((const char*)value) + '"'
-    });
+/// Returns the tag of the current thread.
+inline const std::string& _get_thread_tag() noexcept {
+    if (_context.thread_tag.empty())
+        _context.thread_tag = '[' + (_context.thread_name.empty()
+            ? std::to_string(_get_thread_number())
+            : _context.thread_name) + "] ";
+    return _context.thread_tag;
 }
 
-/// Returns a string representation of the value.
-/// @param value the value to output
-inline std::vector<std::string> to_strings(const std::string& value) noexcept {
-    return std::vector<std::string>({"(std::string)\"" + value + '"'});
+/// Sets the name of the current thread, which is output instead of the thread number.
+/// @param name the name of the thread
+inline void set_thread_name(const char* name) noexcept {
+    _context.thread_name = name;
+    _context.thread_tag.clear();
+    _context.binary_thread_name_changed = true;
 }
 
-/// Convert std::wstring to std::string.
-/// @param wstring the std::wstring
-/// @return a converted std::string
-inline std::string _to_string(const std::wstring& wstring) noexcept {
-#ifdef _WIN32
-    const auto wstringLen = (int)wstring.length();
-    const auto stringLen = WideCharToMultiByte(_code_page, 0, wstring.c_str(), wstringLen, nullptr, 0, 0, 0);
-    std::string string(stringLen, '\0');
-    WideCharToMultiByte(_code_page, 0, wstring.c_str(), wstringLen, &string[0], stringLen, 0, 0);
+/// Returns a string representation of the source location.
+/// @param base_name the source file name without the directory
+/// @param line_number the line number (0: not output)
+inline std::string _get_location(const char* base_name, int line_number) noexcept {
+    if (base_name[0] == '\0')
+        return "";
+    auto location = std::string(" (") + base_name;
+    if (line_number > 0) {
+        location += pair_separator;
+        location += std::to_string(line_number);
+    }
+    location += ')';
+    return location;
+}
+
+/// Splits the variable names of DEBUGTRACE_PRINT with several variables at the commas outside of brackets.
+/// '<' and '>' are taken as brackets only if needed to get the number of the variables,
+/// since they may be operators. If the names still cannot be split, all of them are output before the first value.
+/// @param names the variable names separated by ','
+/// @param count the number of the variables
+/// @return the names followed by varname_value_separator
+inline std::vector<std::string> _get_name_prefixes(const char* names, size_t count) noexcept {
+    std::vector<std::string> prefixes;
+    for (auto angle_brackets = 0; angle_brackets < 2 && prefixes.size() != count; ++angle_brackets) {
+        prefixes.clear();
+        auto depth = 0;
+        auto quote = '\0';
+        auto start = names;
+        for (auto pointer = names; ; ++pointer) {
+            const auto c = *pointer;
+            if (c == '\0' || (c == ',' && depth == 0 && quote == '\0')) {
+                while (*start == ' ')
+                    ++start;
+                prefixes.push_back(std::string(start, pointer) + varname_value_separator);
+                if (c == '\0')
+                    break;
+                start = pointer + 1;
+            } else if (quote != '\0') {
+                if (c == '\\' && pointer[1] != '\0')
+                    ++pointer;
+                else if (c == quote)
+                    quote = '\0';
+            } else if (c == '"' || c == '\'') {
+                quote = c;
+            } else if (c == '(' || c == '[' || c == '{' || (angle_brackets && c == '<')) {
+                ++depth;
+            } else if (c == ')' || c == ']' || c == '}' || (angle_brackets && c == '>')) {
+                --depth;
+            }
+        }
+    }
+    if (prefixes.size() != count) {
+        prefixes.assign(count, "");
+        prefixes[0] = std::string(names) + varname_value_separator;
+    }
+    return prefixes;
+}
+
+inline _CallSite::_CallSite(const char* func_name, const char* signature, const char* file_name, size_t base_name_offset,
+        int line_number, const char* name, unsigned char type_id, size_t name_count, long long slow_call_threshold) noexcept
+    : func_name(func_name), signature(signature), file_name(file_name), base_name(file_name + base_name_offset),
+      line_number(line_number), name(name), type_id(type_id), id(++_call_site_count),
+      location(_get_location(base_name, line_number)),
+      leave_location(_get_location(base_name, 0)),
+      enter_message(std::string(enter_string) + func_name),
+      leave_message(std::string(leave_string) + func_name),
+      name_prefix(name == nullptr ? "" : std::string(name) + varname_value_separator),
+      name_prefixes(name_count > 1 ? _get_name_prefixes(name, name_count) : std::vector<std::string>()),
+      slow_call_threshold(slow_call_threshold) {}
+
+/// Returns true if a string matches a glob pattern.
+/// @param glob the pattern ('*': any characters, '?': any character)
+/// @param string the string
+inline bool _match_glob(const std::string& glob, const char* string) noexcept {
+    size_t index = 0;
+    size_t star_index = std::string::npos; // the index of the last '*' in glob
+    const char* star_string = nullptr;     // the position in string matched with the last '*'
+    while (*string != '\0') {
+        if (index < glob.size() && (glob[index] == '?' || glob[index] == *string)) {
+            ++index;
+            ++string;
+        } else if (index < glob.size() && glob[index] == '*') {
+            star_index = index++;
+            star_string = string;
+        } else if (star_index != std::string::npos) {
+            index = star_index + 1;
+            string = ++star_string;
+        } else {
+            return false;
+        }
+    }
+    while (index < glob.size() && glob[index] == '*')
+        ++index;
+    return index == glob.size();
+}
+
+/// Parses the patterns of the call site filter.
+/// @param filter the patterns (see set_call_site_filter)
+/// @return the parsed patterns
+inline std::vector<_FilterPattern> _parse_call_site_filter(const std::string& filter) noexcept {
+    std::vector<_FilterPattern> patterns;
+    size_t start = 0;
+    while (start <= filter.size()) {
+        auto end = filter.find(';', start);
+        if (end == std::string::npos)
+            end = filter.size();
+        auto first = filter.find_first_not_of(" \t", start);
+        auto last = filter.find_last_not_of(" \t", end - 1);
+        if (first < end && last != std::string::npos && last >= first) {
+            _FilterPattern pattern {true, false, ""};
+            if (filter[first] == '-' || filter[first] == '+')
+                pattern.include = filter[first++] == '+';
+            if (filter.compare(first, 5, "file:") == 0) {
+                pattern.file = true;
+                first += 5;
+            } else if (filter.compare(first, 5, "func:") == 0) {
+                first += 5;
+            }
+            if (first <= last)
+                pattern.glob = filter.substr(first, last + 1 - first);
+            patterns.push_back(std::move(pattern));
+        }
+        start = end + 1;
+    }
+    return patterns;
+}
+
+/// Replaces the patterns of the call site filter and makes every call site evaluate it again.
+/// @param filter the patterns (see set_call_site_filter)
+inline void _set_call_site_filter(const std::string& filter) noexcept {
+    auto patterns = _parse_call_site_filter(filter);
+    std::lock_guard<std::mutex> lock(_configuration_mutex);
+    auto configuration = _copy_configuration();
+    configuration->filter_patterns.swap(patterns);
+    _publish_configuration(std::move(configuration), true);
+}
+
+/// Sets the patterns of the call site filter from the environment variable DEBUGTRACE_FILTER_VARIABLE once.
+inline void _load_call_site_filter() noexcept {
+    static std::once_flag flag;
+    std::call_once(flag, [] {
+#ifdef _MSC_VER
+        // Visual C++
+        char* filter = nullptr;
+        size_t length = 0;
+        if (_dupenv_s(&filter, &length, DEBUGTRACE_FILTER_VARIABLE) == 0 && filter != nullptr) {
+            _set_call_site_filter(filter);
+            std::free(filter);
+        }
+#else
+        const auto filter = std::getenv(DEBUGTRACE_FILTER_VARIABLE);
+        if (filter != nullptr)
+            _set_call_site_filter(filter);
+#endif // _MSC_VER
+    });
+}
+
+/// Sets the call site filter, which selects the functions and the source files to be traced.
+/// The filter is a list of patterns separated by ';' (e.g. "file:*/net/*; -func:*::Socket::poll(*").
+/// "file:" matches the pattern with the source file path and "func:" (or no prefix) with the function signature
+/// (e.g. "void net::Socket::poll(int)" of __PRETTY_FUNCTION__), where '*' matches any characters and '?' any character.
+/// '-' before a pattern excludes the call sites matching it.
+/// A call site is traced if it matches any of the including patterns (or there are none)
+/// and matches none of the excluding patterns. An empty filter traces all call sites.
+/// The environment variable DEBUGTRACE_FILTER sets the filter before the first call site is evaluated.
+/// @param filter the patterns
+inline void set_call_site_filter(const std::string& filter) noexcept {
+    _load_call_site_filter();
+    _set_call_site_filter(filter);
+}
+
+/// Evaluates the call site filter for a call site and caches the verdict in it.
+/// @param site the call site
+/// @return true if the call site is selected
+inline bool _evaluate_call_site_filter(_CallSite& site) noexcept {
+    _load_call_site_filter();
+    // the generation is read first, so that the call site is evaluated again if the filter is changed meanwhile
+    const auto generation = _filter_generation.load(std::memory_order_acquire);
+    auto has_include = false;
+    auto included = false;
+    auto excluded = false;
+    {
+        _ConfigurationReader reader;
+        const auto configuration = reader.get();
+        if (configuration != nullptr) {
+            for (const auto& pattern : configuration->filter_patterns) {
+                const auto matched = _match_glob(pattern.glob, pattern.file ? site.file_name : site.signature);
+                if (pattern.include) {
+                    has_include = true;
+                    included = included || matched;
+                } else {
+                    excluded = excluded || matched;
+                }
+            }
+        }
+    }
+    const auto selected = (!has_include || included) && !excluded;
+    site.filter_state.store(generation << 1 | (selected ? 1u : 0u), std::memory_order_relaxed);
+    return selected;
+}
+
+/// Returns true if a call site is selected by the call site filter.
+/// The verdict is cached in the call site, so the filter is evaluated only on the first call
+/// and after the filter is changed.
+/// @param site the call site
+inline bool _is_selected(_CallSite& site) noexcept {
+    const auto state = site.filter_state.load(std::memory_order_relaxed);
+    if ((state >> 1) == _filter_generation.load(std::memory_order_relaxed))
+        return (state & 1) != 0;
+    return _evaluate_call_site_filter(site);
+}
+
+/// Returns the source location output after the value of DEBUGTRACE_PRINT.
+/// @param site the call site
+/// @return the location of the call site if print_location_enabled is true, otherwise an empty string
+inline const std::string& _get_print_location(const _CallSite& site) noexcept {
+    static const std::string empty;
+    return print_location_enabled ? site.location : empty;
+}
+
+/// Formats the date and time of a second into the cache of the thread.
+/// localtime is called only when the second falls outside of the local hour resolved last,
+/// so the timezone offset resolved by it is reused for other seconds in the hour.
+/// @param context the trace state of the thread
+/// @param second the time in seconds
+inline void _format_log_datetime(_Context& context, std::time_t second) noexcept {
+    auto& tm = context.datetime_tm;
+    const auto seconds_in_hour = context.datetime_base < 0 ? -1
+        : tm.tm_min * 60 + tm.tm_sec + (second - context.datetime_base);
+    if (seconds_in_hour >= 0 && seconds_in_hour < 3600) {
+        tm.tm_min = (int)(seconds_in_hour / 60);
+        tm.tm_sec = (int)(seconds_in_hour % 60);
+    } else {
+#ifdef _MSC_VER
+        // Visual C++
+        localtime_s(&tm, &second);
+#else
+        // Others
+        localtime_r(&second, &tm);
+#endif // _MSC_VER
+    }
+    context.datetime_base = second;
+    context.datetime_second = second;
+
+    if (context.datetime_format != log_datetime_format) {
+        // splits the format after "%S" where the fraction of a second is inserted
+        context.datetime_format = log_datetime_format;
+        const std::string format = log_datetime_format;
+        const auto seconds_position = format.find("%S");
+        const auto split_position = seconds_position == std::string::npos ? format.size() : seconds_position + 2;
+        context.datetime_head_format = format.substr(0, split_position);
+        context.datetime_tail_format = format.substr(split_position);
+    }
+
+    char buff[64];
+    const auto head_length = std::strftime(buff, sizeof(buff), context.datetime_head_format.c_str(), &tm);
+    context.datetime_string.assign(buff, head_length);
+    context.datetime_fraction_position = head_length;
+    const auto tail_length = std::strftime(buff, sizeof(buff), context.datetime_tail_format.c_str(), &tm);
+    context.datetime_string.append(buff, tail_length);
+}
+
+/// Appends the date and time.
+/// The part up to the seconds is formatted only when the second changes,
+/// and the fraction of a second is output in log_datetime_precision digits (0 to 9).
+/// @param string the string to which the date and time is appended
+/// @param nanoseconds the time in nanoseconds since the epoch
+inline void _append_log_datetime(std::string& string, long long nanoseconds) noexcept {
+    auto& context = _context;
+    const auto second = (std::time_t)(nanoseconds / 1000000000);
+    if (second != context.datetime_second || context.datetime_format != log_datetime_format)
+        _format_log_datetime(context, second);
+
+    string.append(context.datetime_string, 0, context.datetime_fraction_position);
+    const auto precision = std::min(std::max(log_datetime_precision, 0), 9);
+    if (precision > 0) {
+        char digits[9];
+        auto fraction = nanoseconds % 1000000000;
+        for (auto index = 8; index >= 0; --index) {
+            digits[index] = (char)('0' + fraction % 10);
+            fraction /= 10;
+        }
+        string += '.';
+        string.append(digits, (size_t)precision);
+    }
+    string.append(context.datetime_string, context.datetime_fraction_position, std::string::npos);
+}
+
+/// Appends the current date and time.
+/// @param string the string to which the date and time is appended
+inline void _append_log_datetime(std::string& string) noexcept {
+    _append_log_datetime(string, (long long)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count());
+}
+
+/// Returns the current time of the steady clock in nanoseconds.
+inline long long _get_steady_nanoseconds() noexcept {
+    return (long long)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/// Sets Windwos Code Page
+/// @param codePage the code page (e.g.: CP_ACP, CP_UTF8)
+inline void set_code_page(unsigned int codePage) {
+    _code_page = codePage;
+}
+
+/// Returns the readable name of a type.
+/// @param type_info the type information
+inline std::string _demangle(const std::type_info& type_info) noexcept {
+#ifdef _MSC_VER
+    // Visual C++
+    return type_info.name();
+#else
+    // gcc, clang
+    int status;
+    char* type_name = abi::__cxa_demangle(type_info.name(), nullptr, nullptr, &status);
+    std::string string = type_name == nullptr ? "?" : type_name;
+    if (type_name != nullptr)
+        free(type_name);
     return string;
+#endif // _MSC_VER
+}
+
+/// Returns the name of the type of the value, which is resolved only once per type.
+/// @param value the value (unused except for its type)
+template <typename T>
+const std::string& _get_type_name(const T&, std::false_type) noexcept {
+    static const std::string type_name = _demangle(typeid(T));
+    return type_name;
+}
+
+/// Returns the name of the dynamic type of the polymorphic value.
+/// The names are cached per thread by the dynamic type.
+/// @param value the value
+template <typename T>
+const std::string& _get_type_name(const T& value, std::true_type) noexcept {
+    thread_local std::unordered_map<std::type_index, std::string> type_names;
+    const std::type_index type_index(typeid(value));
+    auto iterator = type_names.find(type_index);
+    if (iterator == type_names.end())
+        iterator = type_names.emplace(type_index, _demangle(typeid(value))).first;
+    return iterator->second;
+}
+
+/// Returns the name of the type of the value.
+/// @param value the value
+template <typename T>
+const std::string& _get_type_name(const T& value) noexcept {
+    return _get_type_name(value, std::is_polymorphic<T>());
+}
+
+/// Returns true if the value is negative.
+template <typename T>
+bool _is_negative(T value, std::true_type) noexcept {return value < 0;}
+
+/// Returns false for a value of an unsigned type.
+template <typename T>
+bool _is_negative(T, std::false_type) noexcept {return false;}
+
+/// Appends the decimal representation of an integer without creating a temporary string.
+/// @param string the string or Buffer to which the integer is appended
+/// @param value the integer
+template <typename S, typename T>
+void _append_integer(S& string, T value) noexcept {
+    using U = typename std::make_unsigned<T>::type;
+    const auto negative = _is_negative(value, std::is_signed<T>());
+    auto magnitude = negative ? (U)(U(0) - (U)value) : (U)value;
+    char digits[24];
+    auto position = sizeof(digits);
+    do {
+        digits[--position] = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude != 0);
+    if (negative)
+        digits[--position] = '-';
+    string.append(digits + position, sizeof(digits) - position);
+}
+
+/// Appends an integer with thousands separators (e.g. "12,345").
+/// @param string the string to which the integer is appended
+/// @param value the integer
+inline void _append_grouped_integer(std::string& string, unsigned long long value) noexcept {
+    char digits[32];
+    auto position = sizeof(digits);
+    auto count = 0;
+    do {
+        if (count > 0 && count % 3 == 0)
+            digits[--position] = ',';
+        digits[--position] = (char)('0' + value % 10);
+        value /= 10;
+        ++count;
+    } while (value != 0);
+    string.append(digits + position, sizeof(digits) - position);
+}
+
+/// Appends ".0" if the representation of a floating point number looks like an integer.
+/// @param string the string or Buffer to which the number is appended
+/// @param chars the representation
+/// @param length the length of the representation
+template <typename S>
+void _append_floating_chars(S& string, const char* chars, size_t length) noexcept {
+    string.append(chars, length);
+    for (size_t index = 0; index < length; ++index) {
+        const auto c = chars[index];
+        if (c != '-' && (c < '0' || c > '9'))
+            return;
+    }
+    string += ".0";
+}
+
+/// Writes a floating point number in the scientific notation with a precision
+/// and returns the value read back from the representation.
+inline float _format_floating(char* chars, size_t size, int precision, float value, int& length) noexcept {
+    length = std::snprintf(chars, size, "%.*e", precision, (double)value);
+    return std::strtof(chars, nullptr);
+}
+inline double _format_floating(char* chars, size_t size, int precision, double value, int& length) noexcept {
+    length = std::snprintf(chars, size, "%.*e", precision, value);
+    return std::strtod(chars, nullptr);
+}
+inline long double _format_floating(char* chars, size_t size, int precision, long double value, int& length) noexcept {
+    length = std::snprintf(chars, size, "%.*Le", precision, value);
+    return std::strtold(chars, nullptr);
+}
+
+/// Reads back a floating point number.
+inline void _read_floating(const char* chars, float& value) noexcept {value = std::strtof(chars, nullptr);}
+inline void _read_floating(const char* chars, double& value) noexcept {value = std::strtod(chars, nullptr);}
+
+/// Writes a floating point number with an integral value in the fixed notation.
+inline int _format_integral_floating(char* chars, size_t size, double value) noexcept {
+    return std::snprintf(chars, size, "%.0f", value);
+}
+inline int _format_integral_floating(char* chars, size_t size, long double value) noexcept {
+    return std::snprintf(chars, size, "%.0Lf", value);
+}
+
+/// Returns 10 to the power of 0 to 22, which are exact in double.
+inline double _exact_power_of_ten(int exponent) noexcept {
+    static const double powers[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    return powers[exponent];
+}
+
+/// Converts significand * 10^exponent to the nearest double as strtod does,
+/// if it is one correctly rounded operation on exact operands (the fast path of Clinger's algorithm).
+/// @return true if converted
+inline bool _convert_decimal_exactly(unsigned long long significand, int exponent, double& value) noexcept {
+#if defined FLT_EVAL_METHOD && FLT_EVAL_METHOD == 0
+    if (significand <= (1ULL << 53) && exponent >= -22 && exponent <= 22) {
+        const auto power = _exact_power_of_ten(exponent < 0 ? -exponent : exponent);
+        value = exponent < 0 ? (double)significand / power : (double)significand * power;
+        return true;
+    }
 #else
-    mbstate_t mbstate{};
-    char char_buf[wstring.length() * sizeof(std::wstring::value_type) + 1];
-    auto char_ptr = char_buf;
-    for (const auto& wchar : wstring) {
-        const auto converted_count = wcrtomb(char_ptr, wchar, &mbstate);
-        if (converted_count == (size_t)-1)
-            return "<Cannot convert the wstring to string>";
-        char_ptr += converted_count;
-    }
-    *char_ptr = '\0';
-    return char_buf;
-#endif // _WIN32
+    (void)significand; (void)exponent; (void)value;
+#endif
+    return false;
 }
 
-/// Returns a string representation of the value.
+/// Converts significand * 10^exponent to the nearest float as strtof does, if it can be done exactly.
+/// @return true if converted
+inline bool _convert_decimal_exactly(unsigned long long significand, int exponent, float& value) noexcept {
+    double rounded = 0;
+    if (!_convert_decimal_exactly(significand, exponent, rounded))
+        return false;
+    // rounding to double and then to float is the same as rounding to float
+    // unless the double is just halfway between two floats
+    value = (float)rounded;
+    if ((double)value == rounded)
+        return true;
+    const auto next = std::nextafter(value, rounded > (double)value ? HUGE_VALF : -HUGE_VALF);
+    return rounded != ((double)value + (double)next) / 2;
+}
+
+/// Returns whether significand * 10^exponent is read back as the value.
+template <typename T>
+bool _reads_back(T value, unsigned long long significand, int exponent, char* chars, size_t size) noexcept {
+    T read_back = 0;
+    if (!_convert_decimal_exactly(significand, exponent, read_back)) {
+        std::snprintf(chars, size, "%llue%d", significand, exponent);
+        _read_floating(chars, read_back);
+    }
+    return read_back == value;
+}
+
+/// Returns whether significand * 10^exponent is read back as the value,
+/// comparing its distance from the value with half the distance to the adjacent value
+/// (both in the units of the last digit), or converting it if they are too close to tell.
+/// @param error the maximum error of the distance
+template <typename T>
+bool _reads_back(T value, unsigned long long significand, int exponent,
+        double distance, double half_gap, double error, char* chars, size_t size) noexcept {
+    if (distance + error < half_gap * (1 - 1e-9))
+        return true;
+    if (distance - error > half_gap * (1 + 1e-9))
+        return false;
+    return _reads_back(value, significand, exponent, chars, size);
+}
+
+/// Parses "d.ddde[+-]xx" into the digits and the decimal exponent of the first digit.
+inline void _parse_scientific(const char* chars, char* digits, int& digit_count, int& exponent) noexcept {
+    digit_count = 0;
+    for (; *chars != 'e' && *chars != '\0'; ++chars) {
+        if (*chars != '.')
+            digits[digit_count++] = *chars;
+    }
+    exponent = *chars == 'e' ? std::atoi(chars + 1) : 0;
+}
+
+/// Sets the digits of significand * 10^exponent without the trailing zeros.
+inline void _set_decimal_digits(unsigned long long significand, int significand_exponent,
+        char* digits, int& digit_count, int& exponent) noexcept {
+    while (significand % 10 == 0 && significand != 0) {
+        significand /= 10;
+        ++significand_exponent;
+    }
+    char reversed[24];
+    auto count = 0;
+    do {
+        reversed[count++] = (char)('0' + significand % 10);
+        significand /= 10;
+    } while (significand != 0);
+    for (digit_count = 0; digit_count < count; ++digit_count)
+        digits[digit_count] = reversed[count - 1 - digit_count];
+    exponent = significand_exponent + count - 1;
+}
+
+/// Writes the digits of a positive double rounded to the count as snprintf("%.*e") does,
+/// if it is in [2^-8, 2^64) where its integral part and the numerator of its fractional part fit in 64 bits
+/// even when multiplied by 10.
+/// @param value the positive number
+/// @param count the number of the digits (20 at most)
+/// @param digits the array to which the digits are written
+/// @param exponent the decimal exponent of the first digit
+/// @return false if the value is out of the range
+inline bool _write_exact_digits(double value, int count, char* digits, int& exponent) noexcept {
+    uint64_t bits = 0;
+    std::memcpy(&bits, &value, sizeof(bits));
+    const auto binary_exponent = (int)((bits >> 52) & 0x7FF) - 1075;
+    if (binary_exponent < -60 || binary_exponent > 11)
+        return false;
+    const auto significand = (bits & ((1ULL << 52) - 1)) | (1ULL << 52);
+    auto integer = binary_exponent >= 0 ? significand << binary_exponent : significand >> -binary_exponent;
+    const auto fraction_bits = binary_exponent >= 0 ? 0 : -binary_exponent;
+    const auto fraction_mask = fraction_bits == 0 ? 0ULL : (1ULL << fraction_bits) - 1;
+    auto fraction = significand & fraction_mask;
+
+    // the integral digits, and then the fractional digits after the leading zeros
+    char integer_digits[24];
+    auto integer_digit_count = 0;
+    for (; integer != 0; integer /= 10)
+        integer_digits[integer_digit_count++] = (char)('0' + integer % 10);
+    auto digit_count = 0;
+    auto integer_index = integer_digit_count;
+    exponent = integer_digit_count - 1;
+    auto next_digit = [&]() -> char {
+        if (integer_index > 0)
+            return integer_digits[--integer_index];
+        fraction *= 10;
+        const auto digit = (char)('0' + (fraction >> fraction_bits));
+        fraction &= fraction_mask;
+        return digit;
+    };
+    while (digit_count < count) {
+        const auto digit = next_digit();
+        if (digit_count == 0 && digit == '0') {
+            --exponent;
+            continue;
+        }
+        digits[digit_count++] = digit;
+    }
+
+    // rounds half to even with the rest of the digits
+    const auto rest = next_digit();
+    auto sticky = fraction != 0;
+    for (auto index = 0; index < integer_index; ++index)
+        sticky = sticky || integer_digits[index] != '0';
+    if (rest > '5' || (rest == '5' && (sticky || (digits[count - 1] - '0') % 2 != 0))) {
+        auto index = count - 1;
+        for (; index >= 0 && digits[index] == '9'; --index)
+            digits[index] = '0';
+        if (index >= 0) {
+            ++digits[index];
+        } else {
+            digits[0] = '1';
+            ++exponent;
+        }
+    }
+    return true;
+}
+
+/// Finds the shortest digits of a positive floating point number by snprintf with increasing precisions.
+template <typename T>
+void _find_shortest_digits_slowly(T value, char* digits, int& digit_count, int& exponent) noexcept {
+    char chars[64];
+    auto length = 0;
+    // a subnormal number may be read back from fewer digits than digits10
+    const auto subnormal = value < std::numeric_limits<T>::min();
+    for (auto precision = subnormal ? 0 : std::numeric_limits<T>::digits10 - 1;
+            precision < std::numeric_limits<T>::max_digits10; ++precision) {
+        if (_format_floating(chars, sizeof(chars), precision, value, length) == value)
+            break;
+    }
+    _parse_scientific(chars, digits, digit_count, exponent);
+}
+
+inline void _find_shortest_digits(long double value, char* digits, int& digit_count, int& exponent) noexcept {
+    _find_shortest_digits_slowly(value, digits, digit_count, exponent);
+}
+
+/// Finds the shortest digits of a positive float or double which are read back as the same value,
+/// and the closest ones to the value among them.
+/// A short decimal (e.g. 12.34) is found by scaling the value by powers of ten,
+/// and the others by rounding max_digits10 + 2 digits of the value, so that strtod is rarely needed.
+/// @param value the positive number
+/// @param digits the array to which the digits without the trailing zeros are written
+/// @param digit_count the number of the digits
+/// @param exponent the decimal exponent of the first digit
+template <typename T>
+void _find_shortest_digits(T value, char* digits, int& digit_count, int& exponent) noexcept {
+    // the nearest integer of the scaled value is the only candidate below this limit
+    const auto limit = std::is_same<T, float>::value ? (double)(1LL << 22) : (double)(1LL << 50);
+    for (auto fraction = 0; fraction <= 22; ++fraction) {
+        const auto scaled = (double)value * _exact_power_of_ten(fraction);
+        if (scaled >= limit)
+            break;
+        const auto significand = (unsigned long long)(scaled + 0.5);
+        if (significand == 0)
+            continue;
+        T read_back = 0;
+        if (!_convert_decimal_exactly(significand, -fraction, read_back))
+            break;
+        if (read_back == value) {
+            _set_decimal_digits(significand, -fraction, digits, digit_count, exponent);
+            return;
+        }
+    }
+    if (value < std::numeric_limits<T>::min()) {
+        _find_shortest_digits_slowly(value, digits, digit_count, exponent);
+        return;
+    }
+
+    // two more digits than max_digits10, so that a tie in the digits rarely needs the slow search
+    const auto max_digits = std::numeric_limits<T>::max_digits10;
+    char chars[64];
+    char all_digits[64];
+    auto all_digit_count = 0;
+    auto all_exponent = 0;
+    auto exponent_of_two = 0;
+    const auto mantissa = (double)std::frexp(value, &exponent_of_two);
+    all_digit_count = max_digits + 2;
+    if (!_write_exact_digits((double)value, all_digit_count, all_digits, all_exponent)) {
+        std::snprintf(chars, sizeof(chars), "%.*e", max_digits + 1, (double)value);
+        _parse_scientific(chars, all_digits, all_digit_count, all_exponent);
+    }
+    for (auto count = std::numeric_limits<T>::digits10; count <= max_digits; ++count) {
+        auto tie = all_digits[count] == '5';
+        for (auto index = count + 1; tie && index < all_digit_count; ++index)
+            tie = all_digits[index] == '0';
+        if (tie) {
+            // the value itself may be above or below the tie
+            _find_shortest_digits_slowly(value, digits, digit_count, exponent);
+            return;
+        }
+        // the digits after the count digits as a fraction
+        auto tail = 0ULL;
+        for (auto index = count; index < all_digit_count; ++index)
+            tail = tail * 10 + (unsigned long long)(all_digits[index] - '0');
+        const auto tail_scale = _exact_power_of_ten(all_digit_count - count);
+        const auto fraction = (double)tail / tail_scale;
+        auto significand = 0ULL;
+        for (auto index = 0; index < count; ++index)
+            significand = significand * 10 + (unsigned long long)(all_digits[index] - '0');
+        // half the distance to the adjacent values in the units of the last digit
+        const auto half_gap = ((double)significand + fraction)
+            * std::ldexp(0.5, -std::numeric_limits<T>::digits) / mantissa;
+        const auto error = 0.5 / tail_scale;
+        const auto rounded_up = all_digits[count] >= '5';
+        if (rounded_up)
+            ++significand;
+        const auto significand_exponent = all_exponent - (count - 1);
+        // max_digits10 digits are always read back as the same value
+        if (count < max_digits && !_reads_back(value, significand, significand_exponent,
+                rounded_up ? 1 - fraction : fraction, rounded_up || mantissa != 0.5 ? half_gap : half_gap / 2,
+                error, chars, sizeof(chars))) {
+            // the values read back as a power of two spread less below it than above it
+            if (rounded_up || mantissa != 0.5 || !_reads_back(value, ++significand, significand_exponent,
+                    1 - fraction, half_gap, error, chars, sizeof(chars)))
+                continue;
+        }
+        _set_decimal_digits(significand, significand_exponent, digits, digit_count, exponent);
+        return;
+    }
+}
+
+/// Appends the shortest representation of a floating point number which is read back as the same value
+/// (e.g. "-11.11" for -11.11F instead of "-11.110000").
+/// Uses std::to_chars if available. Otherwise finds the shortest digits by _find_shortest_digits,
+/// and chooses the fixed or the scientific notation in the same way as std::to_chars
+/// (the shorter one, or the fixed one if they are as long), so that the output does not depend on the standard.
+/// @param string the string or Buffer to which the number is appended
+/// @param value the floating point number
+template <typename S, typename T>
+void _append_floating(S& string, T value) noexcept {
+    char chars[64];
+#if defined __cpp_lib_to_chars
+    const auto result = std::to_chars(chars, chars + sizeof(chars), value);
+    _append_floating_chars(string, chars, (size_t)(result.ptr - chars));
+#else
+    int length = 0;
+    if (!(value == value) || value - value != value - value) {
+        // NaN or infinity
+        length = std::snprintf(chars, sizeof(chars), "%g", (double)value);
+        string.append(chars, (size_t)std::max(length, 0));
+        return;
+    }
+    const auto negative = std::signbit(value);
+    const auto magnitude = negative ? -value : value;
+    char digits[64];
+    auto digit_count = 1;
+    auto exponent = 0;
+    digits[0] = '0';
+    if (magnitude != 0)
+        _find_shortest_digits(magnitude, digits, digit_count, exponent);
+    while (digit_count > 1 && digits[digit_count - 1] == '0')
+        --digit_count;
+
+    const auto exponent_digit_count = std::abs(exponent) >= 1000 ? 4 : std::abs(exponent) >= 100 ? 3 : 2;
+    const auto scientific_length = digit_count + (digit_count > 1 ? 1 : 0) + 2 + exponent_digit_count;
+    const auto fixed_length = exponent >= digit_count - 1 ? exponent + 1
+        : exponent < 0 ? 2 - exponent - 1 + digit_count : digit_count + 1;
+    length = 0;
+    if (negative)
+        chars[length++] = '-';
+    if (fixed_length <= scientific_length && exponent >= digit_count - 1) {
+        // an integral value is written with all the digits
+        if (magnitude < (T)18446744073709551616.0) {
+            char reversed[24];
+            auto count = 0;
+            for (auto integer = (unsigned long long)magnitude; count == 0 || integer != 0; integer /= 10)
+                reversed[count++] = (char)('0' + integer % 10);
+            while (count > 0)
+                chars[length++] = reversed[--count];
+        } else {
+            using F = typename std::conditional<std::is_same<T, long double>::value, long double, double>::type;
+            length += std::max(_format_integral_floating(chars + length, sizeof(chars) - (size_t)length, (F)magnitude), 0);
+        }
+    } else if (fixed_length <= scientific_length) {
+        if (exponent < 0) {
+            chars[length++] = '0';
+            chars[length++] = '.';
+            for (auto index = 0; index < -exponent - 1; ++index)
+                chars[length++] = '0';
+            for (auto index = 0; index < digit_count; ++index)
+                chars[length++] = digits[index];
+        } else {
+            for (auto index = 0; index < digit_count; ++index) {
+                if (index == exponent + 1)
+                    chars[length++] = '.';
+                chars[length++] = digits[index];
+            }
+        }
+    } else {
+        chars[length++] = digits[0];
+        if (digit_count > 1) {
+            chars[length++] = '.';
+            for (auto index = 1; index < digit_count; ++index)
+                chars[length++] = digits[index];
+        }
+        length += std::snprintf(chars + length, sizeof(chars) - (size_t)length, "e%c%0*d",
+            exponent < 0 ? '-' : '+', exponent_digit_count, std::abs(exponent));
+    }
+    _append_floating_chars(string, chars, (size_t)length);
+#endif // __cpp_lib_to_chars
+}
+
+/// Appends a string representation of the type of the value.
+/// @param string the string or Buffer to which the type is appended
 /// @param value the value to output
-inline std::vector<std::string> to_strings(const std::wstring& value) noexcept {
-    return std::vector<std::string>({"(std::wstring)\"" + _to_string(value)});
+/// @param size the size of the container (-1: not a container)
+template <typename S, typename T>
+void _append_type_string(S& string, const T& value, size_t size = -1) noexcept {
+    string += '(';
+    string += _get_type_name(value);
+    if ((int)size != -1) {
+        string += " size:";
+        _append_integer(string, size);
+    }
+    string += ')';
 }
 
-/// Returns a string representation of the value.
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
 /// @param value the value to output
-inline std::vector<std::string> to_strings(wchar_t* const& value) noexcept {
-    return std::vector<std::string>({value == nullptr
-        ? "(wchar_t*)nullptr"
-        : "(wchar_t*)\"" + _to_string(std::wstring(value)) + '"'
-    });
+inline void to_buffer(Buffer& buffer, const bool& value) noexcept {
+    buffer += value ? "true" : "false";
 }
 
-/// Returns a string representation of the value.
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
 /// @param value the value to output
-inline std::vector<std::string> to_strings(const wchar_t* const& value) noexcept {
-    return std::vector<std::string>({value == nullptr
-        ? "(const wchar_t*)nullptr"
-        : "(const wchar_t*)\"" + _to_string(std::wstring(value)) + '"'
-    });
+inline void to_buffer(Buffer& buffer, const char& value) noexcept {
+    buffer += "(char)";
+    _append_integer(buffer, (int)value);
 }
 
-/// Convert std::u16string to std::string.
-/// @param u16string the std::u16string
-inline std::string _to_string(const std::u16string& u16string) noexcept {
-#ifdef _WIN32
-    const auto u16stringLen = (int)u16string.length();
-    const auto stringLen = WideCharToMultiByte(_code_page, 0, (LPCWCH)u16string.c_str(), u16stringLen, nullptr, 0, 0, 0);
-    std::string string(stringLen, '\0');
-    WideCharToMultiByte(_code_page, 0, (LPCWCH)u16string.c_str(), u16stringLen, &string[0], stringLen, 0, 0);
-    return string;
-#else
-    mbstate_t mbstate{};
-    char char_buf[u16string.length() * sizeof(std::u16string::value_type) + 1];
-    auto char_ptr = char_buf;
-    for (const auto& char16 : u16string) {
-        const auto converted_count = c16rtomb(char_ptr, char16, &mbstate);
-        if (converted_count == (size_t)-1)
-            return "<Cannot convert the u16string to string>";
-        char_ptr += converted_count;
-    }
-    *char_ptr = '\0';
-    return char_buf;
-#endif // _WIN32
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
+/// @param value the value to output
+inline void to_buffer(Buffer& buffer, const signed char& value) noexcept {
+    buffer += "(signed char)";
+    _append_integer(buffer, (int)value);
 }
 
-/// Returns a string representation of the value.
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
 /// @param value the value to output
-inline std::vector<std::string> to_strings(const std::u16string& value) noexcept {
-    return std::vector<std::string>({"(std::u16string)\"" + _to_string(value) + '"'});
+inline void to_buffer(Buffer& buffer, const unsigned char& value) noexcept {
+    buffer += "(unsigned char)";
+    _append_integer(buffer, (int)value);
 }
 
-/// Returns a string representation of the value.
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
 /// @param value the value to output
-inline std::vector<std::string> to_strings(char16_t* const& value) noexcept {
-    return std::vector<std::string>({value == nullptr
-        ? "(char16_t*)nullptr"
-        : "(char16_t*)\"" + _to_string(std::u16string(value)) + '"'
-    });
+inline void to_buffer(Buffer& buffer, const short& value) noexcept {
+    buffer += "(short)";
+    _append_integer(buffer, (int)value);
 }
 
-/// Returns a string representation of the value.
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
 /// @param value the value to output
-inline std::vector<std::string> to_strings(const char16_t* const& value) noexcept {
-    return std::vector<std::string>({value == nullptr
-        ? "(const char16_t*)nullptr"
-        : "(const char16_t*)\"" + _to_string(std::u16string(value)) + '"'
-    });
+inline void to_buffer(Buffer& buffer, const unsigned short& value) noexcept {
+    buffer += "(unsigned short)";
+    _append_integer(buffer, (int)value);
 }
 
-/// Convert std::u32string to std::string.
-/// @param u32string the std::u32string
-inline std::string _to_string(const std::u32string& u32string) noexcept {
-#ifdef _WIN32
-    return "<Unimplemented(string <- u32string)>";
-#else
-    mbstate_t mbstate{};
-    char char_buf[u32string.length() * sizeof(std::u32string::value_type) + 1];
-    auto char_ptr = char_buf;
-    for (const auto& char32 : u32string) {
-        const auto converted_count = c32rtomb(char_ptr, char32, &mbstate);
-        if (converted_count == (size_t)-1)
-            return "<Cannot convert the u32string to string>";
-        char_ptr += converted_count;
-    }
-    *char_ptr = '\0';
-    return char_buf;
-#endif // _WIN32
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
+/// @param value the value to output
+inline void to_buffer(Buffer& buffer, const int& value) noexcept {
+    _append_integer(buffer, value);
 }
 
-/// Returns a string representation of the value.
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
 /// @param value the value to output
-inline std::vector<std::string> to_strings(const std::u32string& value) noexcept {
-    return std::vector<std::string>({"(std::u32string)\"" + _to_string(value) + '"'});
+inline void to_buffer(Buffer& buffer, const unsigned int& value) noexcept {
+    _append_integer(buffer, value);
+    buffer += 'u';
 }
 
-/// Returns a string representation of the value.
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
 /// @param value the value to output
-inline std::vector<std::string> to_strings(char32_t* const& value) noexcept {
-    return std::vector<std::string>({value == nullptr
-        ? "(char32_t*)nullptr"
-        : "(char32_t*)\"" + _to_string(std::u32string(value)) + '"'
-    });
+inline void to_buffer(Buffer& buffer, const long& value) noexcept {
+    _append_integer(buffer, value);
+    buffer += 'l';
+}
+
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
+/// @param value the value to output
+inline void to_buffer(Buffer& buffer, const unsigned long& value) noexcept {
+    _append_integer(buffer, value);
+    buffer += "ul";
+}
+
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
+/// @param value the value to output
+inline void to_buffer(Buffer& buffer, const long long& value) noexcept {
+    _append_integer(buffer, value);
+    buffer += "ll";
+}
+
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
+/// @param value the value to output
+inline void to_buffer(Buffer& buffer, const unsigned long long& value) noexcept {
+    _append_integer(buffer, value);
+    buffer += "ull";
+}
+
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
+/// @param value the value to output
+inline void to_buffer(Buffer& buffer, const float& value) noexcept {
+    _append_floating(buffer, value);
+    buffer += 'f';
+}
+
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
+/// @param value the value to output
+inline void to_buffer(Buffer& buffer, const double& value) noexcept {
+    _append_floating(buffer, value);
+}
+
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
+/// @param value the value to output
+inline void to_buffer(Buffer& buffer, const long double& value) noexcept {
+    _append_floating(buffer, value);
+    buffer += 'l';
+}
+
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
+/// @param value the value to output
+inline void to_buffer(Buffer& buffer, const wchar_t& value) noexcept {
+    buffer += "(wchar_t)";
+    _append_integer(buffer, (int)value);
+}
+
+/// Appends a string in double quotes without copying it elsewhere.
+/// The string is truncated to string_limit bytes (without splitting a UTF-8 sequence)
+/// and "...(N more bytes)" is appended if truncated.
+/// @param buffer the buffer to which the string is appended
+/// @param value the string
+/// @param length the length of the string
+inline void _append_quoted_string(Buffer& buffer, const char* value, size_t length) noexcept {
+    auto visible_length = std::min(length, string_limit);
+    if (visible_length < length) {
+        while (visible_length > 0 && ((unsigned char)value[visible_length] & 0xC0) == 0x80)
+            --visible_length;
+    }
+    buffer += '"';
+    buffer.append(value, visible_length);
+    buffer += '"';
+    if (visible_length < length) {
+        buffer += limit_string;
+        buffer += '(';
+        _append_integer(buffer, length - visible_length);
+        buffer += " more bytes)";
+    }
+}
+
+/// Appends a string representation of a C string.
+/// @param buffer the buffer to which the string is appended
+/// @param type_string the type of the string (e.g. "(char*)")
+/// @param value the C string to output
+inline void _to_buffer_c_string(Buffer& buffer, const char* type_string, const char* value) noexcept {
+    buffer += type_string;
+    if (value == nullptr)
+        buffer += "nullptr";
+    else
+        _append_quoted_string(buffer, value, std::strlen(value));
+}
+
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
+/// @param value the value to output
+inline void to_buffer(Buffer& buffer, char* const& value) noexcept {
+    _to_buffer_c_string(buffer, "(char*)", value);
+}
+
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
+/// @param value the value to output
+inline void to_buffer(Buffer& buffer, const char* const& value) noexcept {
+    _to_buffer_c_string(buffer, "(const char*)", value);
+}
+
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
+/// @param value the value to output
+inline void to_buffer(Buffer& buffer, signed char* const& value) noexcept {
+    _to_buffer_c_string(buffer, "(signed char*)", (const char*)value);
+}
+
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
+/// @param value the value to output
+inline void to_buffer(Buffer& buffer, const signed char* const& value) noexcept {
+    _to_buffer_c_string(buffer, "(const signed char*)", (const char*)value);
+}
+
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
+/// @param value the value to output
+inline void to_buffer(Buffer& buffer, unsigned char* const& value) noexcept {
+    _to_buffer_c_string(buffer, "(unsigned char*)", (const char*)value);
+}
+
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
+/// @param value the value to output
+inline void to_buffer(Buffer& buffer, const unsigned char* const& value) noexcept {
+    _to_buffer_c_string(buffer, "(const unsigned char*)", (const char*)value);
+}
+
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
+/// @param value the value to output
+inline void to_buffer(Buffer& buffer, const std::string& value) noexcept {
+    buffer += "(std::string)";
+    _append_quoted_string(buffer, value.data(), value.size());
+}
+
+#ifdef __cpp_lib_string_view
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
+/// @param value the value to output
+inline void to_buffer(Buffer& buffer, const std::string_view& value) noexcept {
+    buffer += "(std::string_view)";
+    _append_quoted_string(buffer, value.data(), value.size());
+}
+#endif // __cpp_lib_string_view
+
+/// Returns the bits which are set in 8 bytes of code units if any of them is not ASCII.
+/// @param unit_size the size of a code unit (2 or 4)
+constexpr uint64_t _get_non_ascii_mask(size_t unit_size) noexcept {
+    return unit_size == 2 ? 0xFF80FF80FF80FF80ull : 0xFFFFFF80FFFFFF80ull;
+}
+
+/// Returns the length of the valid UTF-8 sequence at the start of the characters, or 0 if it is not valid.
+/// Overlong encodings, surrogates, values over U+10FFFF and truncated sequences are not valid.
+/// @param chars the characters
+/// @param length the number of the characters (1 or more)
+inline size_t _get_utf8_sequence_length(const char* chars, size_t length) noexcept {
+    const auto lead = (unsigned char)chars[0];
+    if (lead < 0x80)
+        return 1;
+    size_t sequence_length;
+    uint32_t code_point;
+    uint32_t minimum;
+    if (lead >= 0xC2 && lead <= 0xDF) {
+        sequence_length = 2; code_point = lead & 0x1Fu; minimum = 0x80;
+    } else if (lead >= 0xE0 && lead <= 0xEF) {
+        sequence_length = 3; code_point = lead & 0x0Fu; minimum = 0x800;
+    } else if (lead >= 0xF0 && lead <= 0xF4) {
+        sequence_length = 4; code_point = lead & 0x07u; minimum = 0x10000;
+    } else {
+        return 0;
+    }
+    if (sequence_length > length)
+        return 0;
+    for (size_t index = 1; index < sequence_length; ++index) {
+        const auto c = (unsigned char)chars[index];
+        if ((c & 0xC0) != 0x80)
+            return 0;
+        code_point = (code_point << 6) | (c & 0x3Fu);
+    }
+    if (code_point < minimum || (code_point >= 0xD800 && code_point <= 0xDFFF) || code_point > 0x10FFFF)
+        return 0;
+    return sequence_length;
+}
+
+/// Appends a string of UTF-16 or UTF-32 code units (or UTF-8 of char8_t) converted to UTF-8,
+/// independently of the locale.
+/// Unpaired surrogates, values over U+10FFFF and invalid UTF-8 bytes are replaced with U+FFFD.
+/// Runs of ASCII characters are checked and copied 8 bytes of code units at a time.
+/// @param string the string or Buffer to which the converted string is appended
+/// @param value the code units
+/// @param length the number of the code units
+template <typename S, typename C>
+void _append_utf8(S& string, const C* value, size_t length) noexcept {
+    if (sizeof(C) == 1) {
+        // valid runs are copied as they are
+        const auto chars = (const char*)value;
+        size_t start = 0;
+        size_t index = 0;
+        while (index < length) {
+            const auto sequence_length = _get_utf8_sequence_length(chars + index, length - index);
+            if (sequence_length > 0) {
+                index += sequence_length;
+                continue;
+            }
+            string.append(chars + start, index - start);
+            string.append("\xEF\xBF\xBD", 3); // the replacement character
+            start = ++index;
+        }
+        string.append(chars + start, index - start);
+        return;
+    }
+    constexpr size_t units_per_word = sizeof(C) == 1 ? 8 : 8 / sizeof(C);
+    constexpr auto non_ascii_mask = _get_non_ascii_mask(sizeof(C));
+    char chars[256]; // converted characters are appended to the string through this array
+    size_t count = 0;
+    size_t index = 0;
+    while (index < length) {
+        if (count > sizeof(chars) - 8) {
+            string.append(chars, count);
+            count = 0;
+        }
+        if (index + units_per_word <= length) {
+            uint64_t word;
+            std::memcpy(&word, value + index, sizeof(word));
+            if ((word & non_ascii_mask) == 0) {
+                for (size_t offset = 0; offset < units_per_word; ++offset)
+                    chars[count++] = (char)value[index + offset];
+                index += units_per_word;
+                continue;
+            }
+        }
+
+        auto code_point = (uint32_t)(typename std::make_unsigned<C>::type)value[index++];
+        if (sizeof(C) == 2 && code_point >= 0xD800 && code_point <= 0xDBFF && index < length) {
+            const auto low = (uint32_t)(typename std::make_unsigned<C>::type)value[index];
+            if (low >= 0xDC00 && low <= 0xDFFF) {
+                code_point = 0x10000 + ((code_point - 0xD800) << 10) + (low - 0xDC00);
+                ++index;
+            }
+        }
+        if ((code_point >= 0xD800 && code_point <= 0xDFFF) || code_point > 0x10FFFF)
+            code_point = 0xFFFD; // the replacement character
+
+        if (code_point < 0x80) {
+            chars[count++] = (char)code_point;
+        } else if (code_point < 0x800) {
+            chars[count++] = (char)(0xC0 | (code_point >> 6));
+            chars[count++] = (char)(0x80 | (code_point & 0x3F));
+        } else if (code_point < 0x10000) {
+            chars[count++] = (char)(0xE0 | (code_point >> 12));
+            chars[count++] = (char)(0x80 | ((code_point >> 6) & 0x3F));
+            chars[count++] = (char)(0x80 | (code_point & 0x3F));
+        } else {
+            chars[count++] = (char)(0xF0 | (code_point >> 18));
+            chars[count++] = (char)(0x80 | ((code_point >> 12) & 0x3F));
+            chars[count++] = (char)(0x80 | ((code_point >> 6) & 0x3F));
+            chars[count++] = (char)(0x80 | (code_point & 0x3F));
+        }
+    }
+    string.append(chars, count);
+}
+
+/// Convert std::wstring to std::string.
+/// @param wstring the std::wstring
+/// @return a converted std::string
+inline std::string _to_string(const std::wstring& wstring) noexcept {
+#ifdef _WIN32
+    const auto wstringLen = (int)wstring.length();
+    const auto stringLen = WideCharToMultiByte(_code_page, 0, wstring.c_str(), wstringLen, nullptr, 0, 0, 0);
+    std::string string(stringLen, '\0');
+    WideCharToMultiByte(_code_page, 0, wstring.c_str(), wstringLen, &string[0], stringLen, 0, 0);
+    return string;
+#else
+    std::string string;
+    _append_utf8(string, wstring.data(), wstring.size());
+    return string;
+#endif // _WIN32
+}
+
+/// Convert std::u16string to std::string.
+/// @param u16string the std::u16string
+inline std::string _to_string(const std::u16string& u16string) noexcept {
+#ifdef _WIN32
+    const auto u16stringLen = (int)u16string.length();
+    const auto stringLen = WideCharToMultiByte(_code_page, 0, (LPCWCH)u16string.c_str(), u16stringLen, nullptr, 0, 0, 0);
+    std::string string(stringLen, '\0');
+    WideCharToMultiByte(_code_page, 0, (LPCWCH)u16string.c_str(), u16stringLen, &string[0], stringLen, 0, 0);
+    return string;
+#else
+    std::string string;
+    _append_utf8(string, u16string.data(), u16string.size());
+    return string;
+#endif // _WIN32
+}
+
+/// Convert std::u32string to std::string.
+/// @param u32string the std::u32string
+inline std::string _to_string(const std::u32string& u32string) noexcept {
+#ifdef _WIN32
+    if (_code_page != CP_UTF8)
+        return "<Unimplemented(string <- u32string)>";
+    std::string string;
+    _append_utf8(string, u32string.data(), u32string.size());
+    return string;
+#else
+    std::string string;
+    _append_utf8(string, u32string.data(), u32string.size());
+    return string;
+#endif // _WIN32
+}
+
+#ifdef __cpp_char8_t
+/// Convert std::u8string to std::string.
+/// @param u8string the std::u8string
+inline std::string _to_string(const std::u8string& u8string) noexcept {
+#ifdef _WIN32
+    if (_code_page == CP_UTF8)
+        return std::string((const char *)u8string.c_str());
+
+    const auto u8stringLen = (int)u8string.length();
+    const auto wstringLen = MultiByteToWideChar(CP_UTF8, 0, (const char *)u8string.c_str(), u8stringLen, nullptr, 0);
+    std::wstring wstring(wstringLen, '\0');
+    MultiByteToWideChar(CP_UTF8, 0, (const char *)u8string.c_str(), u8stringLen, &wstring[0], wstringLen);
+
+    const auto stringLen = WideCharToMultiByte(_code_page, 0, wstring.c_str(), wstringLen, nullptr, 0, 0, 0);
+    std::string string(stringLen, '\0');
+    WideCharToMultiByte(_code_page, 0, wstring.c_str(), wstringLen, &string[0], stringLen, 0, 0);
+    return string;
+#else
+    return std::string((const char *)u8string.c_str());
+#endif // _WIN32
+}
+#endif // __cpp_char8_t
+
+/// Appends a string of wide characters in double quotes after converting it to UTF-8
+/// (or to the code page by _to_string on Windows if the code page is not UTF-8).
+/// The string is truncated to string_limit characters before the conversion
+/// and "...(N more characters)" is appended if truncated.
+/// @param buffer the buffer to which the string is appended
+/// @param value the string
+/// @param length the length of the string
+template <typename C>
+void _append_quoted_string(Buffer& buffer, const C* value, size_t length) noexcept {
+    auto visible_length = std::min(length, string_limit);
+    if (visible_length < length && visible_length > 0) {
+        // does not split a UTF-8 sequence or a surrogate pair
+        if (sizeof(C) == 1) {
+            while (visible_length > 0 && ((unsigned)value[visible_length] & 0xC0) == 0x80)
+                --visible_length;
+        } else if (sizeof(C) == 2 && ((unsigned)value[visible_length - 1] & 0xFC00) == 0xD800) {
+            --visible_length;
+        }
+    }
+    buffer += '"';
+#ifdef _WIN32
+    if (_code_page != CP_UTF8)
+        buffer += _to_string(std::basic_string<C>(value, visible_length));
+    else
+#endif // _WIN32
+    _append_utf8(buffer, value, visible_length);
+    buffer += '"';
+    if (visible_length < length) {
+        buffer += limit_string;
+        buffer += '(';
+        _append_integer(buffer, length - visible_length);
+        buffer += " more characters)";
+    }
+}
+
+/// Appends a string representation of a string of wide characters.
+/// @param buffer the buffer to which the string is appended
+/// @param type_string the type of the string (e.g. "(std::wstring)")
+/// @param value the string or string view to output
+template <typename S>
+void _to_buffer_string(Buffer& buffer, const char* type_string, const S& value) noexcept {
+    buffer += type_string;
+    _append_quoted_string(buffer, value.data(), value.size());
+}
+
+/// Appends a string representation of a C string of wide characters.
+/// @param buffer the buffer to which the string is appended
+/// @param type_string the type of the string (e.g. "(wchar_t*)")
+/// @param value the C string to output
+template <typename C>
+void _to_buffer_c_string(Buffer& buffer, const char* type_string, const C* value) noexcept {
+    buffer += type_string;
+    if (value == nullptr)
+        buffer += "nullptr";
+    else
+        _append_quoted_string(buffer, value, std::char_traits<C>::length(value));
+}
+
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
+/// @param value the value to output
+inline void to_buffer(Buffer& buffer, const std::wstring& value) noexcept {
+    _to_buffer_string(buffer, "(std::wstring)", value);
+}
+
+#ifdef __cpp_lib_string_view
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
+/// @param value the value to output
+inline void to_buffer(Buffer& buffer, const std::wstring_view& value) noexcept {
+    _to_buffer_string(buffer, "(std::wstring_view)", value);
+}
+#endif // __cpp_lib_string_view
+
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
+/// @param value the value to output
+inline void to_buffer(Buffer& buffer, wchar_t* const& value) noexcept {
+    _to_buffer_c_string(buffer, "(wchar_t*)", value);
+}
+
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
+/// @param value the value to output
+inline void to_buffer(Buffer& buffer, const wchar_t* const& value) noexcept {
+    _to_buffer_c_string(buffer, "(const wchar_t*)", value);
+}
+
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
+/// @param value the value to output
+inline void to_buffer(Buffer& buffer, const std::u16string& value) noexcept {
+    _to_buffer_string(buffer, "(std::u16string)", value);
+}
+
+#ifdef __cpp_lib_string_view
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
+/// @param value the value to output
+inline void to_buffer(Buffer& buffer, const std::u16string_view& value) noexcept {
+    _to_buffer_string(buffer, "(std::u16string_view)", value);
+}
+#endif // __cpp_lib_string_view
+
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
+/// @param value the value to output
+inline void to_buffer(Buffer& buffer, char16_t* const& value) noexcept {
+    _to_buffer_c_string(buffer, "(char16_t*)", value);
+}
+
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
+/// @param value the value to output
+inline void to_buffer(Buffer& buffer, const char16_t* const& value) noexcept {
+    _to_buffer_c_string(buffer, "(const char16_t*)", value);
+}
+
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
+/// @param value the value to output
+inline void to_buffer(Buffer& buffer, const std::u32string& value) noexcept {
+    _to_buffer_string(buffer, "(std::u32string)", value);
+}
+
+#ifdef __cpp_lib_string_view
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
+/// @param value the value to output
+inline void to_buffer(Buffer& buffer, const std::u32string_view& value) noexcept {
+    _to_buffer_string(buffer, "(std::u32string_view)", value);
+}
+#endif // __cpp_lib_string_view
+
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
+/// @param value the value to output
+inline void to_buffer(Buffer& buffer, char32_t* const& value) noexcept {
+    _to_buffer_c_string(buffer, "(char32_t*)", value);
+}
+
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
+/// @param value the value to output
+inline void to_buffer(Buffer& buffer, const char32_t* const& value) noexcept {
+    _to_buffer_c_string(buffer, "(const char32_t*)", value);
+}
+
+#ifdef __cpp_char8_t
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
+/// @param value the value to output
+inline void to_buffer(Buffer& buffer, const std::u8string& value) noexcept {
+    _to_buffer_string(buffer, "(std::u8string)", value);
+}
+
+#ifdef __cpp_lib_string_view
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
+/// @param value the value to output
+inline void to_buffer(Buffer& buffer, const std::u8string_view& value) noexcept {
+    _to_buffer_string(buffer, "(std::u8string_view)", value);
+}
+#endif // __cpp_lib_string_view
+
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
+/// @param value the value to output
+inline void to_buffer(Buffer& buffer, char8_t* const& value) noexcept {
+    _to_buffer_c_string(buffer, "(char8_t*)", value);
+}
+
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
+/// @param value the value to output
+inline void to_buffer(Buffer& buffer, const char8_t* const& value) noexcept {
+    _to_buffer_c_string(buffer, "(const char8_t*)", value);
+}
+#endif // __cpp_char8_t
+
+
+template <typename T>
+void to_buffer(Buffer& buffer, const T& value) noexcept;
+
+template <typename T>
+void to_buffer(Buffer& buffer, const T* pointer) noexcept;
+
+template <typename T1, typename T2>
+void to_buffer(Buffer& buffer, const std::pair<T1, T2>& value) noexcept;
+
+template <typename T, size_t N>
+void to_buffer(Buffer& buffer, const std::array<T, N>& container) noexcept;
+
+template <typename T, class Allocator = std::allocator<T>>
+void to_buffer(Buffer& buffer, const std::deque<T, Allocator>& container) noexcept;
+
+template <typename T, class Allocator = std::allocator<T>>
+void to_buffer(Buffer& buffer, const std::list<T, Allocator>& container) noexcept;
+
+template <
+    typename Key,
+    typename T,
+    class Compare = std::less<Key>,
+    class Allocator = std::allocator<std::pair<Key const, T>>
+>
+void to_buffer(Buffer& buffer, const std::map<Key, T, Compare, Allocator>& container) noexcept;
+
+template <
+    typename Key,
+    typename T,
+    class Compare = std::less<Key>,
+    class Allocator = std::allocator<std::pair<Key const, T>>
+>
+void to_buffer(Buffer& buffer, const std::multimap<Key, T, Compare, Allocator>& container) noexcept;
+
+template <
+    typename Key,
+    typename T,
+    class Hash = std::hash<Key>,
+    class Pred = std::equal_to<Key>,
+    class Allocator = std::allocator<std::pair<Key const, T>>
+>
+void to_buffer(Buffer& buffer, const std::unordered_map<Key, T, Hash, Pred, Allocator>& container) noexcept;
+
+template <
+    typename Key,
+    typename T,
+    class Hash = std::hash<Key>,
+    class Pred = std::equal_to<Key>,
+    class Allocator = std::allocator<std::pair<Key const, T>>
+>
+void to_buffer(Buffer& buffer, const std::unordered_multimap<Key, T, Hash, Pred, Allocator>& container) noexcept;
+
+template <
+    typename Key,
+    class Compare = std::less<Key>,
+    class Allocator = std::allocator<Key>
+>
+void to_buffer(Buffer& buffer, const std::set<Key, Compare, Allocator>& container) noexcept;
+
+template <
+    typename Key,
+    class Compare = std::less<Key>,
+    class Allocator = std::allocator<Key>
+>
+void to_buffer(Buffer& buffer, const std::multiset<Key, Compare, Allocator>& container) noexcept;
+
+template <
+    typename Key,
+    class Hash = std::hash<Key>,
+    class Pred = std::equal_to<Key>,
+    class Allocator = std::allocator<Key>
+>
+void to_buffer(Buffer& buffer, const std::unordered_set<Key, Hash, Pred, Allocator>& container) noexcept;
+
+template <
+    typename Key,
+    class Hash = std::hash<Key>,
+    class Pred = std::equal_to<Key>,
+    class Allocator = std::allocator<Key>
+>
+void to_buffer(Buffer& buffer, const std::unordered_multiset<Key, Hash, Pred, Allocator>& container) noexcept;
+
+template <typename T, class Allocator = std::allocator<T>>
+void to_buffer(Buffer& buffer, const std::vector<T, Allocator>& container) noexcept;
+
+template <class C>
+void _to_buffer_container(Buffer& buffer, const C& container) noexcept;
+
+
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
+/// @param value the value to output
+template <typename T>
+void to_buffer(Buffer& buffer, const T& value) noexcept {
+    _append_type_string(buffer, value);
+    buffer += std::to_string(value);
+}
+
+/// Appends a string representation of the value.
+/// @param buffer the buffer to which the string is appended
+/// @param pointer the pointer of the value to output
+template <typename T>
+void to_buffer(Buffer& buffer, const T* pointer) noexcept {
+    _append_type_string(buffer, pointer);
+    if (pointer == nullptr) {
+        buffer += "nullptr";
+    } else {
+        buffer += '&';
+        buffer += std::to_string(*pointer);
+    }
+}
+
+/// Appends a string representation of the value.
+/// If the first line of the second value does not fit in maximum_data_output_width
+/// after the first value, it is moved to the next line.
+/// @param buffer the buffer to which the string is appended
+/// @param value the value to output
+template <typename T1, typename T2>
+void to_buffer(Buffer& buffer, const std::pair<T1, T2>& value) noexcept {
+    const auto start = buffer.size();
+    to_buffer(buffer, value.first);
+    buffer += pair_separator;
+    const auto first_width = buffer.size() - std::max(start, buffer.line_start_of(buffer.size()));
+
+    const auto second_start = buffer.size();
+    to_buffer(buffer, value.second);
+    if (first_width + buffer.line_end_of(second_start) - second_start > _get_maximum_data_output_width())
+        buffer.insert_new_line(second_start);
+}
+
+/// Appends a string representation of the container object.
+/// @param buffer the buffer to which the string is appended
+/// @param container the container object to output
+template <typename T, size_t N>
+void to_buffer(Buffer& buffer, const std::array<T, N>& container) noexcept {
+    _to_buffer_container(buffer, container);
+}
+
+/// Appends a string representation of the container object.
+/// @param buffer the buffer to which the string is appended
+/// @param container the container object to output
+template <typename T, class Allocator>
+void to_buffer(Buffer& buffer, const std::deque<T, Allocator>& container) noexcept {
+    _to_buffer_container(buffer, container);
+}
+
+/// Appends a string representation of the container object.
+/// @param buffer the buffer to which the string is appended
+/// @param container the container object to output
+template <typename T, class Allocator>
+void to_buffer(Buffer& buffer, const std::list<T, Allocator>& container) noexcept {
+    _to_buffer_container(buffer, container);
+}
+
+/// Appends a string representation of the container object.
+/// @param buffer the buffer to which the string is appended
+/// @param container the container object to output
+template <typename Key, typename T, class Compare, class Allocator>
+void to_buffer(Buffer& buffer, const std::map<Key, T, Compare, Allocator>& container) noexcept {
+    _to_buffer_container(buffer, container);
+}
+
+/// Appends a string representation of the container object.
+/// @param buffer the buffer to which the string is appended
+/// @param container the container object to output
+template <typename Key, typename T, class Compare, class Allocator>
+void to_buffer(Buffer& buffer, const std::multimap<Key, T, Compare, Allocator>& container) noexcept {
+    _to_buffer_container(buffer, container);
+}
+
+/// Appends a string representation of the container object.
+/// @param buffer the buffer to which the string is appended
+/// @param container the container object to output
+template <typename Key, typename T, class Hash, class Pred, class Allocator>
+void to_buffer(Buffer& buffer, const std::unordered_map<Key, T, Hash, Pred, Allocator>& container) noexcept {
+    _to_buffer_container(buffer, container);
+}
+
+/// Appends a string representation of the container object.
+/// @param buffer the buffer to which the string is appended
+/// @param container the container object to output
+template <typename Key, typename T, class Hash, class Pred, class Allocator>
+void to_buffer(Buffer& buffer, const std::unordered_multimap<Key, T, Hash, Pred, Allocator>& container) noexcept {
+    _to_buffer_container(buffer, container);
+}
+
+/// Appends a string representation of the container object.
+/// @param buffer the buffer to which the string is appended
+/// @param container the container object to output
+template <typename Key, class Compare, class Allocator>
+void to_buffer(Buffer& buffer, const std::set<Key, Compare, Allocator>& container) noexcept {
+    _to_buffer_container(buffer, container);
+}
+
+/// Appends a string representation of the container object.
+/// @param buffer the buffer to which the string is appended
+/// @param container the container object to output
+template <typename Key, class Compare, class Allocator>
+void to_buffer(Buffer& buffer, const std::multiset<Key, Compare, Allocator>& container) noexcept {
+    _to_buffer_container(buffer, container);
+}
+
+/// Appends a string representation of the container object.
+/// @param buffer the buffer to which the string is appended
+/// @param container the container object to output
+template <typename Key, class Hash, class Pred, class Allocator>
+void to_buffer(Buffer& buffer, const std::unordered_set<Key, Hash, Pred, Allocator>& container) noexcept {
+    _to_buffer_container(buffer, container);
+}
+
+/// Appends a string representation of the container object.
+/// @param buffer the buffer to which the string is appended
+/// @param container the container object to output
+template <typename Key, class Hash, class Pred, class Allocator>
+void to_buffer(Buffer& buffer, const std::unordered_multiset<Key, Hash, Pred, Allocator>& container) noexcept {
+    _to_buffer_container(buffer, container);
+}
+
+/// Appends a string representation of the container object.
+/// @param buffer the buffer to which the string is appended
+/// @param container the container object to output
+template <typename T, class Allocator>
+void to_buffer(Buffer& buffer, const std::vector<T, Allocator>& container) noexcept {
+    _to_buffer_container(buffer, container);
+}
+
+/// Returns the iterator to the first of the last elements of a bidirectional container.
+/// @param container the container object
+/// @param tail_size the number of the last elements
+template <class C>
+typename C::const_iterator _get_tail_begin(const C& container, size_t tail_size, std::true_type) noexcept {
+    return std::prev(container.end(), (typename C::difference_type)tail_size);
+}
+
+/// Returns the end iterator since the tail of a forward-only container cannot be reached without visiting all elements.
+template <class C>
+typename C::const_iterator _get_tail_begin(const C& container, size_t, std::false_type) noexcept {
+    return container.end();
+}
+
+/// Appends a string representation of the container object.
+/// Each element is output only once, one per line, and the lines are joined into one line afterwards
+/// if no element is multi-line and they fit in maximum_data_output_width.
+/// The elements are elided with limit_string after collection_limit elements, after maximum_data_output_size bytes
+/// of the whole value, and below maximum_data_nest_level.
+/// If collection_tail_limit is not 0, the last collection_tail_limit elements of a bidirectional container
+/// are also output after "... (N omitted)", reaching them through the iterators from the end.
+/// @param buffer the buffer to which the string is appended
+/// @param container the container object to output
+template <class C>
+void _to_buffer_container(Buffer& buffer, const C& container) noexcept {
+    const auto start = buffer.size();
+    _append_type_string(buffer, container, container.size());
+    buffer += open_string;
+    const auto elements_start = buffer.size();
+    if (buffer.nest_level() >= maximum_data_nest_level && container.size() > 0) {
+        // the elements are elided below maximum_data_nest_level
+        buffer += limit_string;
+        buffer += close_string;
+        return;
+    }
+
+    buffer.up_nest();
+    const auto limit = _get_collection_limit();
+    const auto maximum_width = _get_maximum_data_output_width();
+    auto line_count = buffer.line_count();
+    auto one_line = true;
+    auto one_line_width = elements_start - start; // the width if output in one line
+    auto count = (size_t)1;
+
+    // Starts the line of an element.
+    const auto new_element = [&] {
+        if (count > 1)
+            buffer += ',';
+        buffer.new_line();
+        return buffer.size();
+    };
+    // Checks if the lines of the elements can still be joined after an element.
+    const auto end_element = [&](size_t element_start) {
+        if (one_line) {
+            one_line_width += (count > 1 ? 2 : 0) + buffer.size() - element_start;
+            line_count += 1;
+            if (buffer.line_count() != line_count || one_line_width > maximum_width)
+                one_line = false;
+        }
+        count += 1;
+    };
+
+    auto iterator = container.begin();
+    for (; iterator != container.end() && count <= limit && !buffer.is_full(); ++iterator) {
+        const auto value_start = new_element();
+        to_buffer(buffer, *iterator);
+        end_element(value_start);
+    }
+
+    auto limited = false;
+    if (iterator != container.end()) {
+        using bidirectional = std::is_base_of<std::bidirectional_iterator_tag,
+            typename std::iterator_traits<typename C::const_iterator>::iterator_category>;
+        const auto output_count = count - 1;
+        if (bidirectional::value && collection_tail_limit > 0 && !buffer.is_full()) {
+            const auto tail_size = std::min(collection_tail_limit, container.size() - output_count);
+            const auto omitted_count = container.size() - output_count - tail_size;
+            if (omitted_count > 0) {
+                const auto marker_start = new_element();
+                buffer += limit_string;
+                buffer += " (";
+                _append_integer(buffer, omitted_count);
+                buffer += " omitted)";
+                end_element(marker_start);
+                iterator = _get_tail_begin(container, tail_size, bidirectional());
+            }
+            for (; iterator != container.end() && !buffer.is_full(); ++iterator) {
+                const auto value_start = new_element();
+                to_buffer(buffer, *iterator);
+                end_element(value_start);
+            }
+        }
+        if (iterator != container.end()) {
+            new_element();
+            buffer += limit_string;
+            limited = true;
+        }
+    }
+
+    if (one_line) {
+        buffer.join_lines(elements_start, " ");
+        buffer.down_nest();
+    } else {
+        if (count > 1 && !limited)
+            buffer += ',';
+        buffer.down_nest();
+        buffer.new_line();
+    }
+    buffer += close_string;
+}
+
+/// Returns a string representation of the value.
+/// This is an adapter of to_buffer which returns the lines in a vector.
+/// @param value the value to output
+template <typename T>
+std::vector<std::string> to_strings(const T& value) noexcept {
+    Buffer buffer;
+    to_buffer(buffer, value);
+    return buffer.lines();
+}
+
+/// A bounded lock-free multi-producer queue of log records.
+/// Each cell holds a sequence number that tells producers and the consumer whose turn it is.
+class _AsyncQueue {
+private:
+    struct _Cell {
+        std::atomic<size_t> sequence;
+        std::string         record;
+    };
+
+    std::unique_ptr<_Cell[]> _cells;
+    size_t _mask = 0;
+    // the positions are kept on separate cache lines (padding is used since C++14 cannot allocate over-aligned types)
+    char _padding1[64];
+    std::atomic<size_t> _enqueue_position {0};
+    char _padding2[64 - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> _dequeue_position {0};
+    char _padding3[64 - sizeof(std::atomic<size_t>)];
+
+public:
+    _AsyncQueue(_AsyncQueue const&) = delete;
+
+    /// Constructs a queue.
+    /// @param capacity the capacity of the queue (rounded up to a power of 2)
+    explicit _AsyncQueue(size_t capacity) noexcept {
+        size_t size = 2;
+        while (size < capacity)
+            size <<= 1;
+        _cells.reset(new _Cell[size]);
+        _mask = size - 1;
+        for (size_t index = 0; index < size; ++index)
+            _cells[index].sequence.store(index, std::memory_order_relaxed);
+    }
+
+    /// Adds a record if the queue is not full.
+    /// The record is swapped with the string held by the cell, so its buffer is reused.
+    /// @param record the record to add
+    /// @return true if added, false if the queue is full
+    bool try_push(std::string& record) noexcept {
+        auto position = _enqueue_position.load(std::memory_order_relaxed);
+        for (;;) {
+            auto& cell = _cells[position & _mask];
+            const auto sequence = cell.sequence.load(std::memory_order_acquire);
+            const auto difference = (std::ptrdiff_t)(sequence - position);
+            if (difference == 0) {
+                if (_enqueue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    cell.record.swap(record);
+                    cell.sequence.store(position + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = _enqueue_position.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /// Removes the oldest record if the queue is not empty.
+    /// @param record the string to which the record is swapped
+    /// @return true if removed, false if the queue is empty
+    bool try_pop(std::string& record) noexcept {
+        auto position = _dequeue_position.load(std::memory_order_relaxed);
+        for (;;) {
+            auto& cell = _cells[position & _mask];
+            const auto sequence = cell.sequence.load(std::memory_order_acquire);
+            const auto difference = (std::ptrdiff_t)(sequence - (position + 1));
+            if (difference == 0) {
+                if (_dequeue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    record.swap(cell.record);
+                    cell.sequence.store(position + _mask + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = _dequeue_position.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /// Returns the number of records added so far.
+    size_t enqueued_count() const noexcept {
+        return _enqueue_position.load(std::memory_order_acquire);
+    }
+
+    /// Returns true if the queue is empty.
+    bool empty() const noexcept {
+        return _dequeue_position.load(std::memory_order_acquire) == _enqueue_position.load(std::memory_order_acquire);
+    }
+};
+
+/// Flushes the sink every flush_interval milliseconds while there are unflushed lines.
+class _FlushTimer {
+private:
+    std::mutex              _mutex;
+    std::condition_variable _condition;
+    bool                    _stopping = false;
+    std::thread             _thread;
+
+    /// Flushes the sink periodically until stopped.
+    void _run() noexcept {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (!_condition.wait_for(lock, std::chrono::milliseconds(std::max(flush_interval, 1)),
+                [this] {return _stopping;})) {
+            std::lock_guard<std::mutex> output_lock(_output_mutex);
+            if (_unflushed_bytes > 0) {
+                _sink->flush();
+                _unflushed_bytes = 0;
+            }
+        }
+    }
+
+public:
+    _FlushTimer(_FlushTimer const&) = delete;
+
+    /// Starts the timer thread.
+    _FlushTimer() noexcept : _thread(&_FlushTimer::_run, this) {}
+
+    /// Stops the timer thread.
+    void stop() noexcept {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stopping = true;
+        }
+        _condition.notify_one();
+        if (_thread.joinable())
+            _thread.join();
+    }
+};
+
+inline void _register_final_flush() noexcept;
+
+/// Flushes the sink according to sink_flush_policy after writing lines.
+/// Called while holding _output_mutex.
+/// @param size the number of bytes written
+/// @param message true if the lines include a line of DEBUGTRACE_MESSAGE or end an asynchronous batch
+inline void _flush_sink_by_policy(size_t size, bool message) noexcept {
+    static bool final_flush_registered = false;
+    if (!final_flush_registered) {
+        final_flush_registered = true;
+        _register_final_flush();
+    }
+    _unflushed_bytes += size;
+    bool flushes = false;
+    switch (sink_flush_policy) {
+    case flush_policy::every_line: flushes = true; break;
+    case flush_policy::bytes     : flushes = _unflushed_bytes >= flush_bytes; break;
+    case flush_policy::interval  :
+        if (_flush_timer.load(std::memory_order_acquire) == nullptr) {
+            static std::once_flag start_flag;
+            std::call_once(start_flag, [] {_flush_timer.store(new _FlushTimer(), std::memory_order_release);});
+        }
+        break;
+    case flush_policy::message   : flushes = message || _unflushed_bytes >= flush_bytes; break;
+    }
+    if (flushes) {
+        _sink->flush();
+        _unflushed_bytes = 0;
+    }
+}
+
+/// Writes log records on a dedicated thread.
+/// Producers push finished lines to a lock-free queue and the writer thread drains them in batches.
+class _AsyncWriter {
+private:
+    _AsyncQueue                         _queue;
+    const overflow_policy               _policy;
+    std::atomic<unsigned long long>     _dropped_count   {0};
+    std::atomic<size_t>                 _completed_count {0};
+    std::atomic<bool>                   _sleeping        {false};
+    std::atomic<bool>                   _stopping        {false};
+    std::atomic<bool>                   _stopped         {false};
+    std::atomic<size_t>                 _pushing_count   {0}; // the number of threads in push
+    std::mutex                          _mutex;
+    std::condition_variable             _writer_condition;
+    std::condition_variable             _flush_condition;
+    std::thread                         _thread;
+
+    /// Writes records in the queue until stopped.
+    void _run() noexcept {
+        std::string batch;
+        std::string record;
+        for (;;) {
+            if (_write_batch(batch, record) > 0)
+                continue;
+            if (_stopping.load(std::memory_order_acquire))
+                break;
+            std::unique_lock<std::mutex> lock(_mutex);
+            _sleeping.store(true, std::memory_order_relaxed);
+            _writer_condition.wait_for(lock, std::chrono::milliseconds(10),
+                [this] {return !_queue.empty() || _stopping.load(std::memory_order_acquire);});
+            _sleeping.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    /// Writes up to async_batch_size records in the queue to the sink at once.
+    /// @return the number of the records written
+    size_t _write_batch(std::string& batch, std::string& record) noexcept {
+        size_t count = 0;
+        batch.clear();
+        while (count < async_batch_size && _queue.try_pop(record)) {
+            batch += record;
+            ++count;
+        }
+        if (count > 0) {
+            {
+                std::lock_guard<std::mutex> lock(_output_mutex);
+                _sink->write(batch.data(), batch.size());
+                _flush_sink_by_policy(batch.size(), true);
+            }
+            _complete(count);
+        }
+        return count;
+    }
+
+    /// Counts records that left the queue and wakes up threads waiting in flush.
+    void _complete(size_t count) noexcept {
+        _completed_count.fetch_add(count, std::memory_order_release);
+        std::lock_guard<std::mutex> lock(_mutex);
+        _flush_condition.notify_all();
+    }
+
+    /// Wakes up the writer thread if it is sleeping.
+    void _wake() noexcept {
+        if (_sleeping.load(std::memory_order_relaxed))
+            _writer_condition.notify_one();
+    }
+
+    /// Adds a log record to the queue while counted in _pushing_count.
+    /// @param record the log record
+    void _push(std::string& record) noexcept {
+        if (_stopped.load(std::memory_order_seq_cst)) {
+            std::lock_guard<std::mutex> lock(_output_mutex);
+            _sink->write(record.data(), record.size());
+            _flush_sink_by_policy(record.size(), true);
+            return;
+        }
+        while (!_queue.try_push(record)) {
+            if (_policy == overflow_policy::drop_newest) {
+                _dropped_count.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            if (_policy == overflow_policy::overwrite_oldest) {
+                std::string oldest;
+                if (_queue.try_pop(oldest)) {
+                    _dropped_count.fetch_add(1, std::memory_order_relaxed);
+                    _complete(1);
+                }
+            } else {
+                // the queue is drained by stop after the writer thread has stopped
+                _writer_condition.notify_one();
+                std::this_thread::yield();
+            }
+        }
+        _wake();
+    }
+
+public:
+    _AsyncWriter() = delete;
+    _AsyncWriter(_AsyncWriter const&) = delete;
+
+    /// Starts the writer thread.
+    /// @param capacity the capacity of the queue
+    /// @param policy the policy applied when the queue is full
+    _AsyncWriter(size_t capacity, overflow_policy policy) noexcept
+        : _queue(capacity), _policy(policy), _thread(&_AsyncWriter::_run, this) {}
+
+    /// Adds a log record to the queue, or writes it directly if the writer has stopped.
+    /// @param record the log record (its buffer is exchanged with a recycled one)
+    void push(std::string& record) noexcept {
+        // counted before checking _stopped so that stop waits for the records being added
+        _pushing_count.fetch_add(1, std::memory_order_seq_cst);
+        _push(record);
+        _pushing_count.fetch_sub(1, std::memory_order_release);
+    }
+
+    /// Waits until all records added before this call have been written.
+    void flush() noexcept {
+        const auto target = _queue.enqueued_count();
+        std::unique_lock<std::mutex> lock(_mutex);
+        _writer_condition.notify_one();
+        _flush_condition.wait(lock,
+            [&] {return _completed_count.load(std::memory_order_acquire) >= target || _stopped.load(std::memory_order_acquire);});
+    }
+
+    /// Writes the remaining records and stops the writer thread.
+    void stop() noexcept {
+        _stopping.store(true, std::memory_order_release);
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _writer_condition.notify_one();
+        }
+        if (_thread.joinable())
+            _thread.join();
+        _stopped.store(true, std::memory_order_seq_cst);
+        // threads which checked _stopped before it was set may still be adding records,
+        // so the queue is drained until none of them remains
+        std::string batch;
+        std::string record;
+        for (;;) {
+            const auto pushing_count = _pushing_count.load(std::memory_order_seq_cst);
+            while (_write_batch(batch, record) > 0)
+                ;
+            if (pushing_count == 0)
+                break;
+            std::this_thread::yield();
+        }
+        std::lock_guard<std::mutex> lock(_mutex);
+        _flush_condition.notify_all();
+    }
+
+    /// Returns the number of records discarded because the queue was full.
+    unsigned long long dropped_count() const noexcept {
+        return _dropped_count.load(std::memory_order_relaxed);
+    }
+};
+
+/// Stops the asynchronous output after writing the remaining records.
+/// Called automatically at exit if the asynchronous output has been started.
+inline void stop_async() noexcept {
+    auto writer = _async_writer.load(std::memory_order_acquire);
+    if (writer != nullptr)
+        writer->stop();
+    // The writer is not deleted since other threads may still refer to it.
+}
+
+/// Starts the asynchronous output.
+/// Log records are added to a lock-free queue and written by a dedicated thread.
+/// @param capacity the capacity of the queue
+/// @param policy the policy applied when the queue is full
+inline void start_async(size_t capacity = async_queue_capacity, overflow_policy policy = async_overflow_policy) noexcept {
+    static std::once_flag at_exit_flag;
+    std::call_once(at_exit_flag, [] {std::atexit([] {stop_async();});});
+    stop_async();
+    _async_writer.store(new _AsyncWriter(capacity, policy), std::memory_order_release);
+}
+
+/// Returns the number of log records discarded because the asynchronous output queue was full.
+inline unsigned long long dropped_count() noexcept {
+    auto writer = _async_writer.load(std::memory_order_acquire);
+    return writer == nullptr ? 0 : writer->dropped_count();
+}
+
+/// Writes a log line to the sink, or adds it to the queue in the asynchronous mode.
+/// @param log_str the log line terminated with '\n' (its contents may be exchanged)
+/// @param message true if the line is output by DEBUGTRACE_MESSAGE
+inline void _write_log(std::string& log_str, bool message = false) noexcept {
+    auto writer = _async_writer.load(std::memory_order_acquire);
+    if (writer != nullptr) {
+        writer->push(log_str);
+    } else {
+        std::lock_guard<std::mutex> lock(_output_mutex);
+        _sink->write(log_str.data(), log_str.size());
+        _flush_sink_by_policy(log_str.size(), message);
+    }
+}
+
+/// Writes the remaining lines at exit.
+inline void _flush_at_exit() noexcept {
+    stop_async();
+    auto timer = _flush_timer.load(std::memory_order_acquire);
+    if (timer != nullptr)
+        timer->stop();
+    std::lock_guard<std::mutex> lock(_output_mutex);
+    _sink->flush();
+    _unflushed_bytes = 0;
+}
+
+/// The signals of crashes on which the sink is flushed and the flight recorder is dumped.
+/// SIGINT and SIGTERM are left to the application.
+#if defined _WIN32
+constexpr std::array<int, 4> _crash_signals {{SIGSEGV, SIGABRT, SIGFPE, SIGILL}};
+#else
+constexpr std::array<int, 5> _crash_signals {{SIGSEGV, SIGABRT, SIGFPE, SIGILL, SIGBUS}};
+#endif
+
+/// A handler of the crash signals which runs an async-signal-safe action once,
+/// then passes the signal to the handler replaced when installed.
+/// On POSIX the handler is installed with sigaction and the whole previous action
+/// (the handler, sa_mask and sa_flags) is restored before the signal is delivered again.
+/// A fault raised by the kernel is delivered again with the original siginfo
+/// when the faulting instruction is executed again, and other signals are raised.
+/// @tparam Action the action (e.g. flushing the sink with write(2))
+template <void (*Action)()>
+class _CrashHook {
+private:
+#if defined _WIN32
+    using _PreviousAction = void (*)(int);
+#else
+    using _PreviousAction = struct sigaction;
+#endif
+
+    /// Returns the actions replaced by the handler.
+    static std::array<_PreviousAction, _crash_signals.size()>& _previous_actions() noexcept {
+        static std::array<_PreviousAction, _crash_signals.size()> actions {};
+        return actions;
+    }
+
+    /// Restores the previous action of the signal.
+    /// @param signal_number the signal
+    static void _restore(int signal_number) noexcept {
+        for (size_t index = 0; index < _crash_signals.size(); ++index) {
+            if (_crash_signals[index] == signal_number) {
+            #if defined _WIN32
+                const auto handler = _previous_actions()[index];
+                std::signal(signal_number, handler == SIG_ERR ? SIG_DFL : handler);
+            #else
+                ::sigaction(signal_number, &_previous_actions()[index], nullptr);
+            #endif
+                break;
+            }
+        }
+    }
+
+#if defined _WIN32
+    static void _handle(int signal_number) noexcept {
+        Action();
+        _restore(signal_number);
+        std::raise(signal_number);
+    }
+#else
+    static void _handle(int signal_number, siginfo_t* info, void*) noexcept {
+        Action();
+        _restore(signal_number);
+        if (info == nullptr || info->si_code <= 0)
+            ::raise(signal_number); // sent by kill, raise or abort
+    }
+#endif
+
+public:
+    /// Installs the handler of the crash signals once.
+    static void install() noexcept {
+        static std::once_flag install_flag;
+        std::call_once(install_flag, [] {
+            for (size_t index = 0; index < _crash_signals.size(); ++index) {
+            #if defined _WIN32
+                _previous_actions()[index] = std::signal(_crash_signals[index], _handle);
+            #else
+                struct sigaction action {};
+                action.sa_sigaction = _handle;
+                sigemptyset(&action.sa_mask);
+                action.sa_flags = SA_SIGINFO | SA_ONSTACK; // SA_ONSTACK: on the alternate stack if the application set one
+                if (::sigaction(_crash_signals[index], &action, &_previous_actions()[index]) != 0) {
+                    _previous_actions()[index] = {};
+                    _previous_actions()[index].sa_handler = SIG_DFL;
+                }
+            #endif
+            }
+        });
+    }
+};
+
+/// Flushes the sink on a crash signal if it can be flushed with async-signal-safe calls (e.g. FileSink).
+/// The output lock is not taken since the crashed thread may hold it, and the lines in the queue
+/// of the asynchronous mode are not written.
+inline void _flush_on_crash_signal() noexcept {
+    const auto sink = _sink.get();
+    if (sink != nullptr)
+        sink->flush_on_signal();
+}
+
+/// Registers the final flush at exit and, if flush_on_fatal_signal is true, on crash signals.
+inline void _register_final_flush() noexcept {
+    std::atexit([] {_flush_at_exit();});
+    if (flush_on_fatal_signal)
+        _CrashHook<_flush_on_crash_signal>::install();
+}
+
+/// Replaces the destination of log lines.
+/// The lines held in the previous sink are flushed.
+/// @param sink the new sink (e.g. std::make_shared<debugtrace::FileSink>("trace.log"))
+inline void set_sink(std::shared_ptr<Sink> sink) noexcept {
+    if (sink == nullptr)
+        return;
+    std::lock_guard<std::mutex> lock(_output_mutex);
+    _sink->flush();
+    std::swap(_sink, sink);
+}
+
+/// Returns the current destination of log lines.
+inline std::shared_ptr<Sink> get_sink() noexcept {
+    std::lock_guard<std::mutex> lock(_output_mutex);
+    return _sink;
+}
+
+/// Appends the bytes of a trivially copyable value to a binary buffer.
+/// @param buffer the binary buffer
+/// @param value the value to append
+template <typename T>
+void _append_bytes(std::string& buffer, const T& value) noexcept {
+    buffer.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+/// Appends a length-prefixed string to a binary buffer.
+/// @param buffer the binary buffer
+/// @param string the string to append
+/// @param length the length of the string
+inline void _append_bytes(std::string& buffer, const char* string, size_t length) noexcept {
+    _append_bytes(buffer, (uint32_t)length);
+    buffer.append(string, length);
+}
+
+/// Writes the binary records buffered by a thread to the file.
+/// @param context the trace state of the thread
+inline void _flush_binary_buffer(_Context& context) noexcept {
+    if (context.binary_buffer.empty())
+        return;
+    std::lock_guard<std::mutex> lock(_binary_mutex);
+    if (_binary_file != nullptr && context.binary_generation == _binary_generation.load(std::memory_order_relaxed))
+        std::fwrite(context.binary_buffer.data(), 1, context.binary_buffer.size(), _binary_file);
+    context.binary_buffer.clear();
+}
+
+/// Writes the trace events buffered by a thread to the file.
+/// @param context the trace state of the thread
+inline void _flush_chrome_buffer(_Context& context) noexcept {
+    if (context.chrome_buffer.empty())
+        return;
+    std::lock_guard<std::mutex> lock(_chrome_mutex);
+    if (_chrome_file != nullptr && context.chrome_generation == _chrome_generation.load(std::memory_order_relaxed))
+        std::fwrite(context.chrome_buffer.data(), 1, context.chrome_buffer.size(), _chrome_file);
+    context.chrome_buffer.clear();
+}
+
+/// Returns the index of the histogram bucket of a time.
+/// @param nanoseconds the time in nanoseconds
+inline size_t _get_histogram_index(long long nanoseconds) noexcept {
+    if (nanoseconds < 8)
+        return nanoseconds < 0 ? 0 : (size_t)nanoseconds;
+    const auto value = (unsigned long long)nanoseconds;
+    size_t exponent = 0; // floor(log2(value))
+    for (size_t shift = 32; shift > 0; shift >>= 1) {
+        if ((value >> (exponent + shift)) != 0)
+            exponent += shift;
+    }
+    return (exponent - 2) * 8 + (size_t)((value >> (exponent - 3)) & 7);
+}
+
+/// Returns the middle time of a histogram bucket.
+/// @param index the index of the bucket
+inline long long _get_histogram_value(size_t index) noexcept {
+    if (index < 8)
+        return (long long)index;
+    const auto shift = index / 8 - 1;
+    const auto lower = (long long)(8 + index % 8) << shift;
+    return lower + ((1LL << shift) - 1) / 2;
+}
+
+/// Adds a profile into another.
+/// @param total the profile to which another is added
+/// @param stats the profile to add
+inline void _merge_profile(_ProfileStats& total, const _ProfileStats& stats) noexcept {
+    if (stats.count == 0)
+        return;
+    total.site = stats.site;
+    total.minimum = total.count == 0 ? stats.minimum : std::min(total.minimum, stats.minimum);
+    total.maximum = total.count == 0 ? stats.maximum : std::max(total.maximum, stats.maximum);
+    total.count += stats.count;
+    total.inclusive += stats.inclusive;
+    total.exclusive += stats.exclusive;
+    for (size_t index = 0; index < _histogram_size; ++index)
+        total.histogram[index] += stats.histogram[index];
+}
+
+/// Adds profiles indexed by the call site id into others.
+/// @param totals the profiles to which others are added
+/// @param stats_list the profiles to add
+inline void _merge_profiles(std::vector<std::unique_ptr<_ProfileStats>>& totals,
+        const std::vector<std::unique_ptr<_ProfileStats>>& stats_list) noexcept {
+    if (totals.size() < stats_list.size())
+        totals.resize(stats_list.size());
+    for (size_t id = 0; id < stats_list.size(); ++id) {
+        if (stats_list[id] == nullptr)
+            continue;
+        if (totals[id] == nullptr)
+            totals[id].reset(new _ProfileStats());
+        _merge_profile(*totals[id], *stats_list[id]);
+    }
+}
+
+/// Records entering a function in the profiling mode.
+/// @param site the call site of DEBUGTRACE_ENTER
+inline void _profile_enter(const _CallSite& site) noexcept {
+    _context.profile_stack.push_back({&site, _get_steady_nanoseconds(), 0});
+}
+
+/// Records leaving a function in the profiling mode and adds its time to the profile of the thread.
+inline void _profile_leave() noexcept {
+    const auto now = _get_steady_nanoseconds();
+    auto& context = _context;
+    if (context.profile_stack.empty())
+        return;
+    const auto frame = context.profile_stack.back();
+    context.profile_stack.pop_back();
+    const auto elapsed = now - frame.start;
+    if (!context.profile_stack.empty())
+        context.profile_stack.back().child_time += elapsed;
+
+    if (!context.profile_registered) {
+        std::lock_guard<std::mutex> lock(_profile_mutex);
+        _profile_contexts.push_back(&context);
+        context.profile_registered = true;
+    }
+
+    std::lock_guard<std::mutex> lock(context.profile_mutex);
+    auto& stats_list = context.profile_stats;
+    const auto id = frame.site->id;
+    if (stats_list.size() <= id)
+        stats_list.resize(id + 1);
+    if (stats_list[id] == nullptr) {
+        stats_list[id].reset(new _ProfileStats());
+        stats_list[id]->site = frame.site;
+    }
+    auto& stats = *stats_list[id];
+    stats.minimum = stats.count == 0 ? elapsed : std::min(stats.minimum, elapsed);
+    stats.maximum = std::max(stats.maximum, elapsed);
+    ++stats.count;
+    stats.inclusive += elapsed;
+    stats.exclusive += elapsed - frame.child_time;
+    ++stats.histogram[_get_histogram_index(elapsed)];
+}
+
+/// Moves the profile of a thread to _profile_totals when the thread exits.
+/// @param context the trace state of the thread
+inline void _unregister_profile(_Context& context) noexcept {
+    if (!context.profile_registered)
+        return;
+    std::lock_guard<std::mutex> lock(_profile_mutex);
+    _profile_contexts.erase(std::remove(_profile_contexts.begin(), _profile_contexts.end(), &context), _profile_contexts.end());
+    _merge_profiles(_profile_totals, context.profile_stats);
+    context.profile_registered = false;
+}
+
+/// Appends a time in a readable unit (e.g. "1.25ms").
+/// @param string the string to which the time is appended
+/// @param nanoseconds the time in nanoseconds
+inline void _append_duration(std::string& string, long long nanoseconds) noexcept {
+    char chars[32];
+    if (nanoseconds < 1000)
+        std::snprintf(chars, sizeof(chars), "%lldns", nanoseconds);
+    else if (nanoseconds < 1000000)
+        std::snprintf(chars, sizeof(chars), "%.2fus", (double)nanoseconds / 1e3);
+    else if (nanoseconds < 1000000000)
+        std::snprintf(chars, sizeof(chars), "%.2fms", (double)nanoseconds / 1e6);
+    else
+        std::snprintf(chars, sizeof(chars), "%.2fs", (double)nanoseconds / 1e9);
+    string += chars;
+}
+
+/// Returns the time of a percentile from the histogram of a profile.
+/// @param stats the profile
+/// @param percentile the percentile (0.0 to 1.0)
+inline long long _get_percentile(const _ProfileStats& stats, double percentile) noexcept {
+    const auto target = std::max((unsigned long long)(percentile * (double)stats.count + 0.999999), 1ull);
+    unsigned long long count = 0;
+    for (size_t index = 0; index < _histogram_size; ++index) {
+        count += stats.histogram[index];
+        if (count >= target)
+            return std::min(std::max(_get_histogram_value(index), stats.minimum), stats.maximum);
+    }
+    return stats.maximum;
+}
+
+/// Outputs the profile of the functions traced by DEBUGTRACE_ENTER in the profiling mode.
+/// The profiles of all threads are merged and output in descending order of the inclusive time.
+inline void print_profile() noexcept {
+    std::vector<std::unique_ptr<_ProfileStats>> totals;
+    {
+        std::lock_guard<std::mutex> lock(_profile_mutex);
+        _merge_profiles(totals, _profile_totals);
+        for (auto context : _profile_contexts) {
+            std::lock_guard<std::mutex> context_lock(context->profile_mutex);
+            _merge_profiles(totals, context->profile_stats);
+        }
+    }
+    std::vector<const _ProfileStats*> stats_list;
+    for (const auto& stats : totals) {
+        if (stats != nullptr && stats->count > 0)
+            stats_list.push_back(stats.get());
+    }
+    std::stable_sort(stats_list.begin(), stats_list.end(),
+        [](const _ProfileStats* stats1, const _ProfileStats* stats2) {return stats1->inclusive > stats2->inclusive;});
+
+    std::string line = "Profile of ";
+    _append_integer(line, stats_list.size());
+    line += " functions\n";
+    _write_log(line);
+    for (const auto stats : stats_list) {
+        line = data_indent_string;
+        line += stats->site->func_name;
+        line += stats->site->location;
+        line += " calls: ";
+        _append_grouped_integer(line, stats->count);
+        line += ", total: ";
+        _append_duration(line, stats->inclusive);
+        line += ", self: ";
+        _append_duration(line, stats->exclusive);
+        line += ", mean: ";
+        _append_duration(line, stats->inclusive / (long long)stats->count);
+        line += ", min: ";
+        _append_duration(line, stats->minimum);
+        line += ", p50: ";
+        _append_duration(line, _get_percentile(*stats, 0.50));
+        line += ", p90: ";
+        _append_duration(line, _get_percentile(*stats, 0.90));
+        line += ", p99: ";
+        _append_duration(line, _get_percentile(*stats, 0.99));
+        line += ", p99.9: ";
+        _append_duration(line, _get_percentile(*stats, 0.999));
+        line += ", max: ";
+        _append_duration(line, stats->maximum);
+        line += '\n';
+        _write_log(line);
+    }
+}
+
+/// Discards the profiles collected so far.
+inline void reset_profile() noexcept {
+    std::lock_guard<std::mutex> lock(_profile_mutex);
+    _profile_totals.clear();
+    for (auto context : _profile_contexts) {
+        std::lock_guard<std::mutex> context_lock(context->profile_mutex);
+        context->profile_stats.clear();
+    }
+}
+
+/// Stops the profiling mode.
+/// The profiles collected so far are kept until reset_profile is called.
+inline void stop_profiling() noexcept {
+    _profiling.store(false, std::memory_order_relaxed);
+}
+
+/// Starts the profiling mode.
+/// In this mode, DEBUGTRACE_ENTER records the time of each call instead of outputting lines,
+/// and the profile is output by print_profile and at exit.
+inline void start_profiling() noexcept {
+    static std::once_flag at_exit_flag;
+    std::call_once(at_exit_flag, [] {std::atexit([] {
+        if (_profiling.load(std::memory_order_relaxed))
+            print_profile();
+    });});
+    _profiling.store(true, std::memory_order_relaxed);
+}
+
+inline _Context::~_Context() noexcept {
+    _flush_binary_buffer(*this);
+    _flush_chrome_buffer(*this);
+    _unregister_profile(*this);
+    if (flight_ring != nullptr)
+        flight_ring->in_use.store(false, std::memory_order_release);
+}
+
+/// Appends the header of a binary record to the buffer of the current thread.
+/// The definitions of the thread name and the call site precede the first record that refers to them,
+/// and the thread name is defined again when it is changed.
+/// @param site the call site
+/// @param type the record type ('E': enter, 'L': leave, 'V': raw value, 'T': text value, 'M': message)
+/// @return the binary buffer
+inline std::string& _begin_binary_record(_CallSite& site, char type) noexcept {
+    auto& context = _context;
+    auto& buffer = context.binary_buffer;
+    const auto thread_number = _get_thread_number();
+    const auto generation = _binary_generation.load(std::memory_order_acquire);
+    if (context.binary_generation != generation) {
+        buffer.clear();
+        context.binary_generation = generation;
+        context.binary_thread_name_changed = !context.thread_name.empty();
+    }
+    if (context.binary_thread_name_changed) {
+        context.binary_thread_name_changed = false;
+        buffer += 'N';
+        _append_bytes(buffer, (uint32_t)thread_number);
+        _append_bytes(buffer, context.thread_name.data(), context.thread_name.size());
+    }
+    if (site.binary_generation.exchange(generation, std::memory_order_relaxed) != generation) {
+        buffer += 'S';
+        _append_bytes(buffer, (uint32_t)site.id);
+        _append_bytes(buffer, (int32_t)site.line_number);
+        buffer += (char)site.type_id;
+        _append_bytes(buffer, site.func_name, std::strlen(site.func_name));
+        _append_bytes(buffer, site.file_name, std::strlen(site.file_name));
+        _append_bytes(buffer, site.name == nullptr ? "" : site.name, site.name == nullptr ? 0 : std::strlen(site.name));
+    }
+    buffer += type;
+    _append_bytes(buffer, (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count());
+    _append_bytes(buffer, (uint32_t)thread_number);
+    _append_bytes(buffer, (uint32_t)site.id);
+    return buffer;
+}
+
+/// Writes the binary buffer of the current thread if it is full.
+inline void _end_binary_record() noexcept {
+    auto& context = _context;
+    if (context.binary_buffer.size() >= binary_buffer_size)
+        _flush_binary_buffer(context);
+}
+
+/// Records a value as raw bytes.
+template <typename T>
+void _record_value(_CallSite& site, const T& value, std::true_type) noexcept {
+    auto& buffer = _begin_binary_record(site, 'V');
+    buffer += (char)sizeof(T);
+    _append_bytes(buffer, value);
+    _end_binary_record();
+}
+
+/// Records a value as a text.
+template <typename T>
+void _record_value(_CallSite& site, const T& value, std::false_type) noexcept {
+    Buffer text;
+    std::swap(text, _context.value_buffer);
+    text.clear();
+    to_buffer(text, value);
+    _append_bytes(_begin_binary_record(site, 'T'), text.string().data(), text.size());
+    std::swap(text, _context.value_buffer);
+    _end_binary_record();
+}
+
+/// Stops the binary recording and closes the file.
+/// Records buffered by other threads are written when those threads exit,
+/// so stop the recording after joining them.
+inline void stop_binary_recording() noexcept {
+    if (!_binary_recording.exchange(false))
+        return;
+    _flush_binary_buffer(_context);
+    std::lock_guard<std::mutex> lock(_binary_mutex);
+    if (_binary_file != nullptr) {
+        std::fclose(_binary_file);
+        _binary_file = nullptr;
+    }
+}
+
+/// Starts recording the trace in the compact binary format instead of the text.
+/// Values of arithmetic types are recorded as raw bytes and formatted later by debugtrace-decode.
+/// @param path the path of the binary file
+/// @return true if started, false if the file cannot be opened
+inline bool start_binary_recording(const char* path) noexcept {
+    static std::once_flag at_exit_flag;
+    std::call_once(at_exit_flag, [] {std::atexit([] {stop_binary_recording();});});
+    stop_binary_recording();
+    auto file = std::fopen(path, "wb");
+    if (file == nullptr)
+        return false;
+    std::fwrite(DEBUGTRACE_BINARY_MAGIC, 1, sizeof(DEBUGTRACE_BINARY_MAGIC) - 1, file);
+    {
+        std::lock_guard<std::mutex> lock(_binary_mutex);
+        _binary_file = file;
+        _binary_generation.fetch_add(1, std::memory_order_release);
+    }
+    _binary_recording.store(true, std::memory_order_release);
+    return true;
+}
+
+/// Appends the characters of a string escaped for a JSON string literal (without the quotation marks).
+/// Bytes which are not valid UTF-8 are written as \ufffd (the replacement character).
+/// @param buffer the buffer to which the characters are appended
+/// @param string the string
+/// @param length the length of the string
+inline void _append_json_chars(std::string& buffer, const char* string, size_t length) noexcept {
+    static const char hex_digits[] = "0123456789abcdef";
+    for (size_t index = 0; index < length; ++index) {
+        const auto c = string[index];
+        if ((unsigned char)c >= 0x80) {
+            const auto sequence_length = _get_utf8_sequence_length(string + index, length - index);
+            if (sequence_length == 0) {
+                buffer += "\\ufffd";
+            } else {
+                buffer.append(string + index, sequence_length);
+                index += sequence_length - 1;
+            }
+            continue;
+        }
+        switch (c) {
+        case '"' : buffer += "\\\""; break;
+        case '\\': buffer += "\\\\"; break;
+        case '\n': buffer += "\\n"; break;
+        case '\r': buffer += "\\r"; break;
+        case '\t': buffer += "\\t"; break;
+        default:
+            if ((unsigned char)c < 0x20) {
+                buffer += "\\u00";
+                buffer += hex_digits[(unsigned char)c >> 4];
+                buffer += hex_digits[(unsigned char)c & 0xF];
+            } else {
+                buffer += c;
+            }
+        }
+    }
+}
+
+/// Appends a string as a JSON string literal.
+/// @param buffer the buffer to which the literal is appended
+/// @param string the string
+/// @param length the length of the string
+inline void _append_json_string(std::string& buffer, const char* string, size_t length) noexcept {
+    buffer += '"';
+    _append_json_chars(buffer, string, length);
+    buffer += '"';
+}
+
+/// Returns the id of the current process.
+inline unsigned long _get_process_id() noexcept {
+#ifdef _WIN32
+    return (unsigned long)GetCurrentProcessId();
+#else
+    return (unsigned long)getpid();
+#endif // _WIN32
+}
+
+/// Appends a trace event to the buffer of the current thread up to its "args" object.
+/// The metadata event of the thread name precedes the first event of the thread.
+/// @param site the call site
+/// @param phase the phase of the event ('B': begin, 'E': end, 'i': instant)
+/// @param category the category of the event
+/// @param name the name of the event
+/// @param name_length the length of the name
+/// @return the buffer
+inline std::string& _begin_chrome_event(const _CallSite& site, char phase, const char* category,
+        const char* name, size_t name_length) noexcept {
+    auto& context = _context;
+    auto& buffer = context.chrome_buffer;
+    const auto thread_number = _get_thread_number();
+    const auto generation = _chrome_generation.load(std::memory_order_acquire);
+    if (context.chrome_generation != generation) {
+        buffer.clear();
+        context.chrome_generation = generation;
+        buffer += ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":";
+        _append_integer(buffer, _get_process_id());
+        buffer += ",\"tid\":";
+        _append_integer(buffer, thread_number);
+        buffer += ",\"args\":{\"name\":";
+        std::string thread_name = context.thread_name.empty()
+            ? "Thread " + std::to_string(thread_number) : context.thread_name;
+        _append_json_string(buffer, thread_name.data(), thread_name.size());
+        buffer += "}}";
+    }
+
+    buffer += ",\n{\"name\":";
+    _append_json_string(buffer, name, name_length);
+    buffer += ",\"cat\":\"";
+    buffer += category;
+    buffer += "\",\"ph\":\"";
+    buffer += phase;
+    if (phase == 'i')
+        buffer += "\",\"s\":\"t";
+    buffer += "\",\"ts\":";
+    const auto nanoseconds = _get_steady_nanoseconds();
+    _append_integer(buffer, nanoseconds / 1000);
+    buffer += '.';
+    const auto fraction = (int)(nanoseconds % 1000);
+    buffer += (char)('0' + fraction / 100);
+    buffer += (char)('0' + fraction / 10 % 10);
+    buffer += (char)('0' + fraction % 10);
+    buffer += ",\"pid\":";
+    _append_integer(buffer, _get_process_id());
+    buffer += ",\"tid\":";
+    _append_integer(buffer, thread_number);
+    buffer += ",\"args\":{\"location\":\"";
+    _append_json_chars(buffer, site.base_name, std::strlen(site.base_name));
+    if (site.line_number > 0) {
+        _append_json_chars(buffer, pair_separator, std::strlen(pair_separator));
+        _append_integer(buffer, site.line_number);
+    }
+    buffer += '"';
+    return buffer;
+}
+
+/// Closes the trace event and writes the buffer of the current thread if it is full.
+inline void _end_chrome_event() noexcept {
+    auto& context = _context;
+    context.chrome_buffer += "}}";
+    if (context.chrome_buffer.size() >= chrome_buffer_size)
+        _flush_chrome_buffer(context);
+}
+
+/// Records entering or leaving a function as a trace event.
+/// @param site the call site of DEBUGTRACE_ENTER
+/// @param phase 'B' (entering) or 'E' (leaving)
+inline void _trace_chrome_scope(const _CallSite& site, char phase) noexcept {
+    _begin_chrome_event(site, phase, "function", site.func_name, std::strlen(site.func_name));
+    _end_chrome_event();
+}
+
+/// Records a message as an instant event.
+/// @param site the call site of DEBUGTRACE_MESSAGE
+/// @param message the message
+/// @param length the length of the message
+inline void _trace_chrome_message(const _CallSite& site, const char* message, size_t length) noexcept {
+    _begin_chrome_event(site, 'i', "message", message, length);
+    _end_chrome_event();
+}
+
+/// Records a value as an instant event whose "value" argument is the string representation.
+/// @param site the call site of DEBUGTRACE_PRINT
+/// @param value the value
+template <typename T>
+void _trace_chrome_value(const _CallSite& site, const T& value) noexcept {
+    Buffer text;
+    std::swap(text, _context.value_buffer);
+    text.clear();
+    to_buffer(text, value);
+    auto& buffer = _begin_chrome_event(site, 'i', "print", site.name, std::strlen(site.name));
+    buffer += ",\"value\":";
+    _append_json_string(buffer, text.string().data(), text.size());
+    std::swap(text, _context.value_buffer);
+    _end_chrome_event();
+}
+
+/// Stops the Chrome trace and closes the file.
+/// Events buffered by other threads are written when those threads exit,
+/// so stop the trace after joining them.
+inline void stop_chrome_trace() noexcept {
+    if (!_chrome_tracing.exchange(false))
+        return;
+    _flush_chrome_buffer(_context);
+    std::lock_guard<std::mutex> lock(_chrome_mutex);
+    if (_chrome_file != nullptr) {
+        std::fputs("\n]\n", _chrome_file);
+        std::fclose(_chrome_file);
+        _chrome_file = nullptr;
+    }
+}
+
+/// Starts writing the trace as a JSON file of the Chrome Trace Event Format instead of the text,
+/// which can be opened with Perfetto (https://ui.perfetto.dev) or chrome://tracing.
+/// DEBUGTRACE_ENTER is written as "B" and "E" events,
+/// and DEBUGTRACE_PRINT and DEBUGTRACE_MESSAGE are written as instant events.
+/// Each thread buffers up to chrome_buffer_size bytes of events before writing them.
+/// @param path the path of the JSON file
+/// @return true if started, false if the file cannot be opened
+inline bool start_chrome_trace(const char* path) noexcept {
+    static std::once_flag at_exit_flag;
+    std::call_once(at_exit_flag, [] {std::atexit([] {stop_chrome_trace();});});
+    stop_chrome_trace();
+    auto file = std::fopen(path, "wb");
+    if (file == nullptr)
+        return false;
+    std::fprintf(file, "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%lu,\"args\":{\"name\":\"DebugTrace-cpp\"}}",
+        _get_process_id());
+    {
+        std::lock_guard<std::mutex> lock(_chrome_mutex);
+        _chrome_file = file;
+        _chrome_generation.fetch_add(1, std::memory_order_release);
+    }
+    _chrome_tracing.store(true, std::memory_order_release);
+    return true;
+}
+
+/// The number of the rings after which a ring released by an exited thread is reused.
+/// Until then, the records of exited threads are kept for dumps.
+constexpr size_t _flight_ring_reuse_threshold = 64;
+
+/// Returns the flight recorder ring of the current thread.
+inline _FlightRing& _get_flight_ring() noexcept {
+    auto& context = _context;
+    if (context.flight_ring != nullptr)
+        return *context.flight_ring;
+
+    _FlightRing* ring = nullptr;
+    size_t ring_count = 0;
+    for (auto candidate = _flight_rings.load(std::memory_order_acquire); candidate != nullptr; candidate = candidate->next)
+        ++ring_count;
+    for (auto candidate = _flight_rings.load(std::memory_order_acquire);
+            candidate != nullptr && ring_count >= _flight_ring_reuse_threshold; candidate = candidate->next) {
+        auto in_use = false;
+        if (candidate->capacity == flight_recorder_capacity
+                && candidate->in_use.compare_exchange_strong(in_use, true, std::memory_order_acq_rel)) {
+            ring = candidate;
+            ring->count.store(0, std::memory_order_release);
+            break;
+        }
+    }
+    if (ring == nullptr) {
+        ring = new _FlightRing();
+        ring->capacity = std::max(flight_recorder_capacity, (size_t)1);
+        ring->records.reset(new _FlightRecord[ring->capacity]);
+        std::lock_guard<std::mutex> lock(_flight_ring_mutex);
+        // the cursors of dumps are enlarged first, so that there is always one for each ring
+        ring_count = 1;
+        for (auto candidate = _flight_rings.load(std::memory_order_relaxed); candidate != nullptr; candidate = candidate->next)
+            ++ring_count;
+        const auto cursors = _flight_cursors.load(std::memory_order_relaxed);
+        if (cursors == nullptr || cursors->capacity < ring_count) {
+            auto new_cursors = new _FlightCursors();
+            new_cursors->capacity = std::max(cursors == nullptr ? _flight_ring_reuse_threshold : cursors->capacity * 2, ring_count);
+            new_cursors->cursors.reset(new _FlightCursor[new_cursors->capacity]);
+            _flight_cursors.store(new_cursors, std::memory_order_release);
+        }
+        ring->next = _flight_rings.load(std::memory_order_relaxed);
+        _flight_rings.store(ring, std::memory_order_release);
+    }
+    const auto& thread_tag = thread_tag_enabled ? _get_thread_tag() : std::string();
+    ring->thread_tag_length = std::min(thread_tag.size(), sizeof(ring->thread_tag));
+    std::memcpy(ring->thread_tag, thread_tag.data(), ring->thread_tag_length);
+    context.flight_ring = ring;
+    return *ring;
+}
+
+/// Fills the next record of the flight recorder of the current thread.
+/// The record is published by _end_flight_record.
+/// @param site the call site
+/// @param type the record type ('E': enter, 'L': leave, 'V': value, 'M': message)
+/// @param text the value or the message
+/// @param length the length of the text
+inline void _add_flight_record(const _CallSite& site, char type, const char* text = "", size_t length = 0) noexcept {
+    auto& context = _context;
+    auto& ring = _get_flight_ring();
+    const auto count = ring.count.load(std::memory_order_relaxed);
+    auto& record = ring.records[count % ring.capacity];
+    record.timestamp = (long long)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    record.site = &site;
+    record.type = type;
+    record.nest_level = context.code_nest_level;
+    record.blank_before = false;
+    record.length = length;
+    std::memcpy(record.text, text, std::min(length, sizeof(record.text)));
+    if (type == 'E') {
+        record.blank_before = context.before_code_nest_level > context.code_nest_level;
+        context.before_code_nest_level = context.code_nest_level;
+        ++context.code_nest_level;
+    } else if (type == 'L') {
+        context.before_code_nest_level = context.code_nest_level;
+        --context.code_nest_level;
+        record.nest_level = context.code_nest_level;
+    }
+    ring.count.store(count + 1, std::memory_order_release);
+}
+
+/// Records a value in the flight recorder.
+/// @param site the call site of DEBUGTRACE_PRINT
+/// @param value the value
+template <typename T>
+void _add_flight_value(const _CallSite& site, const T& value) noexcept {
+    Buffer buffer;
+    std::swap(buffer, _context.value_buffer);
+    buffer.clear();
+    to_buffer(buffer, value);
+    _add_flight_record(site, 'V', buffer.string().data(), buffer.size());
+    std::swap(buffer, _context.value_buffer);
+}
+
+/// Writes the dump of the flight recorder through a fixed buffer (async-signal-safe).
+class _FlightWriter {
+private:
+    char   _chars[4096];
+    size_t _size = 0;
+
+public:
+    ~_FlightWriter() noexcept {flush();}
+
+    void append(const char* string, size_t length) noexcept {
+        while (length > 0) {
+            if (_size == sizeof(_chars))
+                flush();
+            const auto count = std::min(length, sizeof(_chars) - _size);
+            std::memcpy(_chars + _size, string, count);
+            _size += count;
+            string += count;
+            length -= count;
+        }
+    }
+
+    void append(const char* string) noexcept {append(string, std::strlen(string));}
+
+    void append(const std::string& string) noexcept {append(string.data(), string.size());}
+
+    /// Appends an unsigned integer padded with zeros.
+    void append_number(unsigned long long value, int width) noexcept {
+        char digits[24];
+        auto position = sizeof(digits);
+        do {
+            digits[--position] = (char)('0' + value % 10);
+            value /= 10;
+            --width;
+        } while (value != 0 || width > 0);
+        append(digits + position, sizeof(digits) - position);
+    }
+
+    void flush() noexcept {
+        _write_to_descriptor(flight_recorder_descriptor, _chars, _size);
+        _size = 0;
+    }
+};
+
+/// Writes the date and time of a record in the default log_datetime_format (in the time zone when started).
+/// The date is calculated without localtime, which is not async-signal-safe.
+/// @param writer the writer
+/// @param nanoseconds the time in nanoseconds since the epoch
+inline void _write_flight_datetime(_FlightWriter& writer, long long nanoseconds) noexcept {
+    const auto seconds = nanoseconds / 1000000000 + _flight_utc_offset;
+    auto days = seconds / 86400;
+    auto second_of_day = seconds % 86400;
+    if (second_of_day < 0) {
+        second_of_day += 86400;
+        --days;
+    }
+    // the civil date from the days since 1970-01-01 (Howard Hinnant's algorithm)
+    days += 719468;
+    const auto era = (days >= 0 ? days : days - 146096) / 146097;
+    const auto day_of_era = days - era * 146097;
+    const auto year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+    const auto day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    const auto month_index = (5 * day_of_year + 2) / 153;
+    const auto day = day_of_year - (153 * month_index + 2) / 5 + 1;
+    const auto month = month_index < 10 ? month_index + 3 : month_index - 9;
+    const auto year = year_of_era + era * 400 + (month <= 2 ? 1 : 0);
+
+    writer.append_number((unsigned long long)year, 4);
+    writer.append("-", 1);
+    writer.append_number((unsigned long long)month, 2);
+    writer.append("-", 1);
+    writer.append_number((unsigned long long)day, 2);
+    writer.append(" ", 1);
+    writer.append_number((unsigned long long)(second_of_day / 3600), 2);
+    writer.append(":", 1);
+    writer.append_number((unsigned long long)(second_of_day / 60 % 60), 2);
+    writer.append(":", 1);
+    writer.append_number((unsigned long long)(second_of_day % 60), 2);
+    const auto precision = std::min(std::max(log_datetime_precision, 0), 9);
+    if (precision > 0) {
+        auto fraction = (unsigned long long)(nanoseconds % 1000000000);
+        for (auto index = precision; index < 9; ++index)
+            fraction /= 10;
+        writer.append(".", 1);
+        writer.append_number(fraction, precision);
+    }
+    writer.append(_flight_zone.data());
+}
+
+/// Writes the lines of a record in the text format.
+/// @param writer the writer
+/// @param ring the ring of the record
+/// @param record the record
+inline void _write_flight_record(_FlightWriter& writer, const _FlightRing& ring, const _FlightRecord& record) noexcept {
+    const auto& site = *record.site;
+    const auto write_prefix = [&] {
+        _write_flight_datetime(writer, record.timestamp);
+        writer.append(" ", 1);
+        writer.append(ring.thread_tag, ring.thread_tag_length);
+        for (auto index = 0; index < record.nest_level && index < maximum_indents; ++index)
+            writer.append(code_indent_string);
+    };
+    if (record.blank_before) {
+        write_prefix();
+        writer.append("\n", 1);
+    }
+    write_prefix();
+    switch (record.type) {
+    case 'E':
+        writer.append(site.enter_message);
+        writer.append(site.location);
+        break;
+    case 'L':
+        writer.append(site.leave_message);
+        writer.append(site.leave_location);
+        break;
+    default:
+        if (record.type == 'V')
+            writer.append(site.name_prefix);
+        const auto length = std::min(record.length, sizeof(record.text));
+        for (size_t index = 0; index < length; ++index) {
+            if (record.text[index] == '\n') {
+                writer.append("\n", 1);
+                write_prefix();
+            } else {
+                writer.append(record.text + index, 1);
+            }
+        }
+        if (length < record.length)
+            writer.append(limit_string);
+        // the values of DEBUGTRACE_PRINT (whose call sites have the names) are followed by the location if enabled
+        if (site.name == nullptr || print_location_enabled)
+            writer.append(site.location);
+        break;
+    }
+    writer.append("\n", 1);
+}
+
+/// Writes the records of all threads in the flight recorder to flight_recorder_descriptor
+/// in the text format, merged in the order of time.
+/// The code is async-signal-safe so that it can be called in a signal handler.
+/// Records being added by other threads at the same time may be broken.
+/// A dump started while another is in progress (e.g. on a crash in the middle of a dump) writes only a note.
+inline void dump_flight_recorder() noexcept {
+    _FlightWriter writer;
+    if (_flight_dumping.exchange(true, std::memory_order_acquire)) {
+        writer.append("Flight recorder dump skipped: another dump is in progress\n");
+        return;
+    }
+    const auto cursors = _flight_cursors.load(std::memory_order_acquire);
+    size_t cursor_count = 0;
+    unsigned long long omitted_count = 0;
+    for (auto ring = _flight_rings.load(std::memory_order_acquire); ring != nullptr; ring = ring->next) {
+        if (cursors == nullptr || cursor_count >= cursors->capacity) {
+            ++omitted_count; // added after the cursors were loaded
+            continue;
+        }
+        const auto end = ring->count.load(std::memory_order_acquire);
+        cursors->cursors[cursor_count++] = {ring, end > ring->capacity ? end - ring->capacity : 0, end};
+    }
+
+    writer.append("Flight recorder dump\n");
+    if (omitted_count != 0) {
+        writer.append_number(omitted_count, 1);
+        writer.append(" rings omitted\n");
+    }
+    for (;;) {
+        _FlightCursor* earliest = nullptr;
+        for (size_t index = 0; index < cursor_count; ++index) {
+            auto& cursor = cursors->cursors[index];
+            if (cursor.position < cursor.end && (earliest == nullptr
+                    || cursor.ring->records[cursor.position % cursor.ring->capacity].timestamp
+                     < earliest->ring->records[earliest->position % earliest->ring->capacity].timestamp))
+                earliest = &cursor;
+        }
+        if (earliest == nullptr)
+            break;
+        _write_flight_record(writer, *earliest->ring, earliest->ring->records[earliest->position % earliest->ring->capacity]);
+        ++earliest->position;
+    }
+    writer.flush();
+    _flight_dumping.store(false, std::memory_order_release);
 }
 
-/// Returns a string representation of the value.
-/// @param value the value to output
-inline std::vector<std::string> to_strings(const char32_t* const& value) noexcept {
-    return std::vector<std::string>({value == nullptr
-        ? "(const char32_t*)nullptr"
-        : "(const char32_t*)\"" + _to_string(std::u32string(value)) + '"'
-    });
+/// Dumps the flight recorder once on a crash if it is recording.
+inline void _dump_flight_recorder_on_crash() noexcept {
+    if (_flight_recording.load(std::memory_order_acquire) && !_flight_crash_dumped.exchange(true))
+        dump_flight_recorder();
 }
 
-#ifdef __cpp_char8_t
-/// Convert std::u8string to std::string.
-/// @param u8string the std::u8string
-inline std::string _to_string(const std::u8string& u8string) noexcept {
-#ifdef _WIN32
-    if (_code_page == CP_UTF8)
-        return std::string((const char *)u8string.c_str());
+/// Stops the flight recorder. The records are kept until the next start.
+inline void stop_flight_recorder() noexcept {
+    _flight_recording.store(false, std::memory_order_release);
+}
 
-    const auto u8stringLen = (int)u8string.length();
-    const auto wstringLen = MultiByteToWideChar(CP_UTF8, 0, (const char *)u8string.c_str(), u8stringLen, nullptr, 0);
-    std::wstring wstring(wstringLen, '\0');
-    MultiByteToWideChar(CP_UTF8, 0, (const char *)u8string.c_str(), u8stringLen, &wstring[0], wstringLen);
+/// Starts the flight recorder instead of the text output.
+/// Each thread keeps its last flight_recorder_capacity records in memory and nothing is output,
+/// until the records are dumped to flight_recorder_descriptor by dump_flight_recorder,
+/// on a crash signal (SIGSEGV, SIGABRT, SIGBUS, SIGFPE or SIGILL) or on std::terminate.
+/// Values and messages longer than DEBUGTRACE_FLIGHT_RECORD_TEXT_SIZE bytes are truncated.
+inline void start_flight_recorder() noexcept {
+    static std::once_flag terminate_flag;
+    std::call_once(terminate_flag, [] {
+        static std::terminate_handler previous_handler = std::set_terminate([] {
+            _dump_flight_recorder_on_crash();
+            if (previous_handler != nullptr)
+                previous_handler();
+            std::abort();
+        });
+    });
+    _CrashHook<_dump_flight_recorder_on_crash>::install();
 
-    const auto stringLen = WideCharToMultiByte(_code_page, 0, wstring.c_str(), wstringLen, nullptr, 0, 0, 0);
-    std::string string(stringLen, '\0');
-    WideCharToMultiByte(_code_page, 0, wstring.c_str(), wstringLen, &string[0], stringLen, 0, 0);
-    return string;
+    // the time zone is resolved here since localtime cannot be called in a signal handler
+    const auto now = std::time(nullptr);
+    std::tm local_tm {};
+#ifdef _WIN32
+    localtime_s(&local_tm, &now);
 #else
-    return std::string((const char *)u8string.c_str());
+    localtime_r(&now, &local_tm);
 #endif // _WIN32
+    char zone[8] = "";
+    std::strftime(zone, sizeof(zone), "%z", &local_tm);
+    _flight_zone.fill('\0');
+    std::memcpy(_flight_zone.data(), zone, std::min(std::strlen(zone), _flight_zone.size() - 1));
+    if ((zone[0] == '+' || zone[0] == '-') && std::strlen(zone) == 5) {
+        const auto minutes = ((zone[1] - '0') * 10 + (zone[2] - '0')) * 60 + (zone[3] - '0') * 10 + (zone[4] - '0');
+        _flight_utc_offset = (zone[0] == '-' ? -60L : 60L) * minutes;
+    }
+    _flight_crash_dumped.store(false);
+    _flight_recording.store(true, std::memory_order_release);
 }
 
-/// Returns a string representation of the value.
-/// @param value the value to output
-inline std::vector<std::string> to_strings(const std::u8string& value) noexcept {
-    return std::vector<std::string>({"(std::u8string)\"" + _to_string(value) + '"'});
+/// Stops capturing slow calls. The calls being captured are output when they are left if they are slow.
+inline void stop_slow_call_capture() noexcept {
+    _slow_call_capture.store(false, std::memory_order_relaxed);
 }
 
-/// Returns a string representation of the value.
-/// @param value the value to output
-inline std::vector<std::string> to_strings(char8_t* const& value) noexcept {
-    return std::vector<std::string>({value == nullptr
-        ? "(char8_t*)nullptr"
-        : "(char8_t*)\"" + _to_string((std::u8string(value))) + '"'
-    });
+/// Starts capturing slow calls.
+/// The lines of each outermost scope of DEBUGTRACE_ENTER, including the values and messages output in it,
+/// are kept in memory until the scope is left, and output only if the call took slow_call_threshold
+/// (or the threshold of DEBUGTRACE_ENTER_SLOW) or longer. The lines of the other calls are discarded.
+/// Lines beyond slow_call_buffer_size bytes per call are dropped and counted.
+inline void start_slow_call_capture() noexcept {
+    _slow_call_capture.store(true, std::memory_order_relaxed);
 }
 
-/// Returns a string representation of the value.
-/// @param value the value to output
-inline std::vector<std::string> to_strings(const char8_t* const& value) noexcept {
-    return std::vector<std::string>({value == nullptr
-        ? "(const char8_t*)nullptr"
-        : "(const char8_t*)\"" + _to_string((std::u8string(value))) + '"'
-    });
+/// Reads a configuration file.
+/// @param path the path of the file
+/// @param contents the string to which the contents are read
+/// @return true if read, false if the file cannot be opened
+inline bool _read_configuration_file(const char* path, std::string& contents) noexcept {
+    auto file = std::fopen(path, "rb");
+    if (file == nullptr)
+        return false;
+    char chars[4096];
+    size_t size;
+    while ((size = std::fread(chars, 1, sizeof(chars), file)) > 0)
+        contents.append(chars, size);
+    std::fclose(file);
+    return true;
 }
-#endif // __cpp_char8_t
-
-
-template <typename T>
-std::vector<std::string> to_strings(const T& value) noexcept;
 
-template <typename T>
-std::vector<std::string> to_strings(const T* pointer) noexcept;
+/// Applies the contents of a configuration file (see load_configuration).
+/// The whole file is read into a new snapshot first, then the snapshot, the switches and the sink are applied
+/// at once while no line is written.
+/// @param contents the contents
+inline void _apply_configuration(const std::string& contents) noexcept {
+    const auto trim = [](const std::string& string, size_t start, size_t end) {
+        start = std::min(string.find_first_not_of(" \t\r", start), end);
+        while (end > start && (string[end - 1] == ' ' || string[end - 1] == '\t' || string[end - 1] == '\r'))
+            --end;
+        return string.substr(start, end - start);
+    };
+    const auto to_size = [](const std::string& value, size_t& size) {
+        char* end = nullptr;
+        const auto number = std::strtoull(value.c_str(), &end, 10);
+        if (value.empty() || value[0] == '-' || *end != '\0')
+            return false;
+        size = (size_t)number;
+        return true;
+    };
 
-template <typename T1, typename T2>
-std::vector<std::string> to_strings(const std::pair<T1, T2>& value) noexcept;
+    _load_call_site_filter(); // so that DEBUGTRACE_FILTER does not replace the filter of the file later
+    std::lock_guard<std::mutex> lock(_configuration_mutex);
+    auto configuration = _copy_configuration();
+    auto configuration_changed = false;
+    auto filter_changed = false;
+    auto mask_bits = 0u;   // the bits of _trace_mask set by the file
+    auto mask_values = 0u; // the values of the bits
+    std::shared_ptr<Sink> sink;
+    size_t start = 0;
+    while (start < contents.size()) {
+        auto end = contents.find('\n', start);
+        if (end == std::string::npos)
+            end = contents.size();
+        const auto first = std::min(contents.find_first_not_of(" \t", start), end);
+        const auto separator = contents.find('=', start);
+        if (first < end && contents[first] != '#' && separator < end) {
+            const auto key = trim(contents, start, separator);
+            const auto value = trim(contents, separator + 1, end);
+            size_t size = 0;
+            if (key == "enabled") {
+                if (value == "true" || value == "false") {
+                    mask_bits |= _master_switch;
+                    mask_values = value == "true" ? mask_values | _master_switch : mask_values & ~_master_switch;
+                }
+            } else if (key == "categories") {
+                auto categories = 0u;
+                auto valid = true;
+                for (size_t name_start = 0; name_start <= value.size(); ) {
+                    auto name_end = std::min(value.find(',', name_start), value.size());
+                    const auto name = trim(value, name_start, name_end);
+                    if      (name == "enter"  ) categories |= category::enter;
+                    else if (name == "print"  ) categories |= category::print;
+                    else if (name == "message") categories |= category::message;
+                    else if (name == "all"    ) categories |= category::all;
+                    else if (name != "none"   ) valid = false;
+                    name_start = name_end + 1;
+                }
+                if (valid) {
+                    mask_bits |= category::all;
+                    mask_values = (mask_values & ~category::all) | categories;
+                }
+            } else if (key == "filter") {
+                configuration->filter_patterns = _parse_call_site_filter(value);
+                filter_changed = true;
+            } else if (key == "collection_limit") {
+                if (to_size(value, size)) {
+                    configuration->collection_limit = size;
+                    configuration->collection_limit_set = true;
+                    configuration_changed = true;
+                }
+            } else if (key == "maximum_data_output_width") {
+                if (to_size(value, size)) {
+                    configuration->maximum_data_output_width = size;
+                    configuration->maximum_data_output_width_set = true;
+                    configuration_changed = true;
+                }
+            } else if (key == "sampling_factor") {
+                char* number_end = nullptr;
+                const auto factor = std::strtod(value.c_str(), &number_end);
+                if (!value.empty() && *number_end == '\0' && factor > 0.0 && factor <= 1e9) {
+                    configuration->sampling_factor = factor;
+                    configuration_changed = true;
+                }
+            } else if (key == "sink" && !value.empty() && value != configuration->sink_name) {
+                std::shared_ptr<Sink> new_sink;
+                if (value == "stderr")
+                    new_sink = std::make_shared<StreamSink>(std::cerr);
+                else if (value == "stdout")
+                    new_sink = std::make_shared<StreamSink>(std::cout);
+                else {
+                    auto file_sink = std::make_shared<FileSink>(value.c_str());
+                    if (file_sink->is_open())
+                        new_sink = std::move(file_sink);
+                }
+                if (new_sink != nullptr) {
+                    sink = std::move(new_sink);
+                    configuration->sink_name = value;
+                    configuration_changed = true;
+                }
+            }
+        }
+        start = end + 1;
+    }
 
-template <typename T, size_t N>
-std::vector<std::string> to_strings(const std::array<T, N>& container) noexcept;
+    // the previous snapshot is freed after the output lock is released
+    _RetiredConfiguration retired;
+    std::lock_guard<std::mutex> output_lock(_output_mutex);
+    if (sink != nullptr) {
+        _sink->flush();
+        std::swap(_sink, sink);
+    }
+    if (configuration_changed || filter_changed)
+        retired = _publish_configuration(std::move(configuration), filter_changed);
+    if (mask_bits != 0) {
+        // enabled and categories are set with a single update
+        auto mask = _trace_mask.load(std::memory_order_relaxed);
+        while (!_trace_mask.compare_exchange_weak(mask, (mask & ~mask_bits) | mask_values, std::memory_order_relaxed)) {}
+    }
+}
 
-template <typename T, class Allocator = std::allocator<T>>
-std::vector<std::string> to_strings(const std::deque<T, Allocator>& container) noexcept;
+/// Applies a configuration file, which can change the settings while other threads are tracing.
+/// Each line is "<key> = <value>" or a comment beginning with '#', and the keys are:
+///   enabled                   - true or false (see enable and disable)
+///   categories                - the categories separated by ',' (enter, print, message, all or none)
+///   filter                    - the call site filter (see set_call_site_filter)
+///   collection_limit          - replaces collection_limit
+///   maximum_data_output_width - replaces maximum_data_output_width
+///   sampling_factor           - multiplies the calls output by DEBUGTRACE_ENTER_EVERY, DEBUGTRACE_PRINT_SAMPLED,
+///                               DEBUGTRACE_PRINT_RATE and so on (e.g. 10: every 100th call instead of every 1000th)
+///   sink                      - stderr, stdout or the path of a file to which the lines are appended
+/// The settings not in the file are left unchanged, and unknown keys and invalid values are ignored.
+/// The settings of a file are applied together after the whole file is read, while no line is written.
+/// Once the file sets collection_limit or maximum_data_output_width, it takes precedence over the variable.
+/// @param path the path of the file
+/// @return true if applied, false if the file cannot be opened
+inline bool load_configuration(const char* path) noexcept {
+    std::string contents;
+    if (!_read_configuration_file(path, contents))
+        return false;
+    _apply_configuration(contents);
+    return true;
+}
 
-template <typename T, class Allocator = std::allocator<T>>
-std::vector<std::string> to_strings(const std::list<T, Allocator>& container) noexcept;
+/// Applies a configuration file whenever its contents change.
+/// On Linux the directory of the file is watched with inotify, so that a file written or renamed into place
+/// is applied at once. Elsewhere, or if inotify cannot be used, the file is checked
+/// every configuration_check_interval milliseconds.
+class _ConfigurationWatcher {
+private:
+    std::string             _path;
+    std::string             _contents; // the contents applied last
+    std::mutex              _mutex;
+    std::condition_variable _condition;
+    bool                    _stopping = false;
+#if defined __linux__
+    std::string             _name;                // the file name in the directory
+    int                     _inotify = -1;        // the inotify descriptor (-1: checks periodically)
+    int                     _wake_pipe[2] {-1, -1}; // the pipe written by stop to wake the thread
+#endif
+    std::thread             _thread;
 
-template <
-    typename Key,
-    typename T,
-    class Compare = std::less<Key>,
-    class Allocator = std::allocator<std::pair<Key const, T>>
->
-std::vector<std::string> to_strings(const std::map<Key, T, Compare, Allocator>& container) noexcept;
+    /// Applies the file if its contents changed.
+    void _check() noexcept {
+        std::string contents;
+        if (_read_configuration_file(_path.c_str(), contents) && contents != _contents) {
+            _apply_configuration(contents);
+            _contents.swap(contents);
+        }
+    }
 
-template <
-    typename Key,
-    typename T,
-    class Compare = std::less<Key>,
-    class Allocator = std::allocator<std::pair<Key const, T>>
->
-std::vector<std::string> to_strings(const std::multimap<Key, T, Compare, Allocator>& container) noexcept;
+#if defined __linux__
+    /// Starts watching the directory of the file with inotify.
+    /// @return true if started, false if inotify cannot be used
+    bool _start_inotify() noexcept {
+        const auto separator = _path.rfind('/');
+        const auto directory = separator == std::string::npos ? std::string(".")
+            : separator == 0 ? std::string("/") : _path.substr(0, separator);
+        _name = separator == std::string::npos ? _path : _path.substr(separator + 1);
+        _inotify = ::inotify_init1(IN_CLOEXEC);
+        if (_inotify >= 0 && ::inotify_add_watch(_inotify, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) >= 0
+                && ::pipe2(_wake_pipe, O_CLOEXEC) == 0)
+            return true;
+        _close_inotify();
+        return false;
+    }
 
-template <
-    typename Key,
-    typename T,
-    class Hash = std::hash<Key>,
-    class Pred = std::equal_to<Key>,
-    class Allocator = std::allocator<std::pair<Key const, T>>
->
-std::vector<std::string> to_strings(const std::unordered_map<Key, T, Hash, Pred, Allocator>& container) noexcept;
+    /// Closes the descriptors of inotify.
+    void _close_inotify() noexcept {
+        for (auto descriptor : {_inotify, _wake_pipe[0], _wake_pipe[1]}) {
+            if (descriptor >= 0)
+                ::close(descriptor);
+        }
+        _inotify = _wake_pipe[0] = _wake_pipe[1] = -1;
+    }
 
-template <
-    typename Key,
-    typename T,
-    class Hash = std::hash<Key>,
-    class Pred = std::equal_to<Key>,
-    class Allocator = std::allocator<std::pair<Key const, T>>
->
-std::vector<std::string> to_strings(const std::unordered_multimap<Key, T, Hash, Pred, Allocator>& container) noexcept;
+    /// Checks the file whenever it is written or renamed into place until stopped.
+    /// @return false if inotify failed and the file is to be checked periodically
+    bool _run_inotify() noexcept {
+        alignas(inotify_event) char events[4096];
+        pollfd descriptors[2] {{_inotify, POLLIN, 0}, {_wake_pipe[0], POLLIN, 0}};
+        for (;;) {
+            if (::poll(descriptors, 2, -1) < 0) {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            if (descriptors[1].revents != 0)
+                return true; // stopped
+            const auto length = ::read(_inotify, events, sizeof(events));
+            if (length <= 0) {
+                if (length < 0 && errno == EINTR)
+                    continue;
+                return false;
+            }
+            auto changed = false;
+            for (ssize_t offset = 0; offset < length; ) {
+                const auto event = reinterpret_cast<const inotify_event*>(events + offset);
+                changed = changed || (event->mask & IN_Q_OVERFLOW) != 0 || (event->len != 0 && _name == event->name);
+                offset += (ssize_t)(sizeof(inotify_event) + event->len);
+            }
+            if (changed)
+                _check();
+        }
+    }
+#endif // __linux__
 
-template <
-    typename Key,
-    class Compare = std::less<Key>,
-    class Allocator = std::allocator<Key>
->
-std::vector<std::string> to_strings(const std::set<Key, Compare, Allocator>& container) noexcept;
+    /// Checks the file until stopped.
+    void _run() noexcept {
+    #if defined __linux__
+        if (_inotify >= 0 && _run_inotify())
+            return;
+    #endif
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (!_condition.wait_for(lock, std::chrono::milliseconds(std::max(configuration_check_interval, 1)),
+                [this] {return _stopping;}))
+            _check();
+    }
 
-template <
-    typename Key,
-    class Compare = std::less<Key>,
-    class Allocator = std::allocator<Key>
->
-std::vector<std::string> to_strings(const std::multiset<Key, Compare, Allocator>& container) noexcept;
+public:
+    _ConfigurationWatcher(_ConfigurationWatcher const&) = delete;
 
-template <
-    typename Key,
-    class Hash = std::hash<Key>,
-    class Pred = std::equal_to<Key>,
-    class Allocator = std::allocator<Key>
->
-std::vector<std::string> to_strings(const std::unordered_set<Key, Hash, Pred, Allocator>& container) noexcept;
+    /// Starts the thread watching a file.
+    /// @param path the path of the file
+    /// @param contents the contents already applied
+    _ConfigurationWatcher(const char* path, std::string contents) noexcept
+        : _path(path), _contents(std::move(contents)) {
+    #if defined __linux__
+        _start_inotify();
+    #endif
+        _thread = std::thread(&_ConfigurationWatcher::_run, this);
+    }
 
-template <
-    typename Key,
-    class Hash = std::hash<Key>,
-    class Pred = std::equal_to<Key>,
-    class Allocator = std::allocator<Key>
->
-std::vector<std::string> to_strings(const std::unordered_multiset<Key, Hash, Pred, Allocator>& container) noexcept;
+    ~_ConfigurationWatcher() noexcept {
+    #if defined __linux__
+        _close_inotify();
+    #endif
+    }
 
-template <typename T, class Allocator = std::allocator<T>>
-std::vector<std::string> to_strings(const std::vector<T, Allocator>& container) noexcept;
+    /// Stops the thread.
+    void stop() noexcept {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stopping = true;
+        }
+        _condition.notify_one();
+    #if defined __linux__
+        if (_wake_pipe[1] >= 0) {
+            const char byte = 0;
+            while (::write(_wake_pipe[1], &byte, 1) < 0 && errno == EINTR) {}
+        }
+    #endif
+        if (_thread.joinable())
+            _thread.join();
+    }
 
-template <class C>
-std::vector<std::string> _to_strings_container(const C& container) noexcept;
+    _ConfigurationWatcher& operator =(const _ConfigurationWatcher&) = delete;
+};
 
+/// Stops watching the configuration file. The settings applied are kept.
+inline void stop_watching_configuration() noexcept {
+    auto watcher = _configuration_watcher.exchange(nullptr, std::memory_order_acq_rel);
+    if (watcher != nullptr) {
+        watcher->stop();
+        delete watcher;
+    }
+}
 
-/// Returns a string representation of the value.
-/// @param value the value to output
-template <typename T>
-std::vector<std::string> to_strings(const T& value) noexcept {
-    return std::vector<std::string>({_get_type_string(value) + std::to_string(value)});
+/// Applies a configuration file (see load_configuration) now and whenever its contents change.
+/// The file is watched even if it does not exist yet, so that it can be created while the process runs.
+/// @param path the path of the file
+/// @return true if applied now, false if the file cannot be opened
+inline bool watch_configuration(const char* path) noexcept {
+    static std::once_flag at_exit_flag;
+    std::call_once(at_exit_flag, [] {std::atexit([] {stop_watching_configuration();});});
+    stop_watching_configuration();
+    std::string contents;
+    const auto loaded = _read_configuration_file(path, contents);
+    if (loaded)
+        _apply_configuration(contents);
+    _configuration_watcher.store(new _ConfigurationWatcher(path, std::move(contents)), std::memory_order_release);
+    return loaded;
 }
 
-/// Returns a string representation of the value.
-/// @param pointer the pointer of the value to output
-template <typename T>
-std::vector<std::string> to_strings(const T* pointer) noexcept {
-    return std::vector<std::string>({pointer == nullptr
-        ? _get_type_string(pointer) + "nullptr"
-        : _get_type_string(pointer) + "&" + std::to_string(*pointer)
-    });
+#ifndef _WIN32
+/// Returns the actions of SIGUSR1 and SIGUSR2 replaced by enable_signal_control.
+inline std::array<struct sigaction, 2>& _previous_control_actions() noexcept {
+    static std::array<struct sigaction, 2> actions {};
+    return actions;
 }
 
-/// Returns a string representation of the value.
-/// @param value the value to output
-template <typename T1, typename T2>
-std::vector<std::string> to_strings(const std::pair<T1, T2>& value) noexcept {
-    auto firstStrings = to_strings(value.first);
-    auto secondStrings = to_strings(value.second);
-
-    firstStrings.back() += pair_separator;
-
-    auto index = 0;
-    for (const auto& secondString : secondStrings) {
-        if (index == 0) {
-            if (firstStrings.back().size() + secondString.size() <= maximum_data_output_width)
-                // one line
-                firstStrings.back() += secondString;
-            else
-                firstStrings.push_back(_get_data_indent_string() + secondString);
-        } else {
-            firstStrings.push_back(secondString);
-        }
-        ++index;
+/// Enables tracing on SIGUSR1 and disables it on SIGUSR2,
+/// then passes the signal to the handler replaced if the application had one.
+/// @param signal_number the signal
+/// @param info the information of the signal
+/// @param context the context of the interrupted thread
+inline void _control_by_signal(int signal_number, siginfo_t* info, void* context) noexcept {
+    if (signal_number == SIGUSR1)
+        enable();
+    else
+        disable();
+    const auto& previous = _previous_control_actions()[signal_number == SIGUSR1 ? 0 : 1];
+    if ((previous.sa_flags & SA_SIGINFO) != 0) {
+        if (previous.sa_sigaction != nullptr)
+            previous.sa_sigaction(signal_number, info, context);
+    } else if (previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN) {
+        previous.sa_handler(signal_number);
     }
-
-    return firstStrings;
 }
+#endif
 
-/// Returns a string representation of the container object.
-/// @param container the container object to output
-template <typename T, size_t N>
-std::vector<std::string> to_strings(const std::array<T, N>& container) noexcept {
-    return _to_strings_container(container);
+/// Makes SIGUSR1 enable tracing and SIGUSR2 disable it (e.g. kill -USR1 <pid>).
+/// The handlers are installed once with sigaction, and the handlers which they replace are still called
+/// (but not the default action, which would terminate the process).
+/// Does nothing on Windows, which has no such signals.
+inline void enable_signal_control() noexcept {
+#ifndef _WIN32
+    static std::once_flag install_flag;
+    std::call_once(install_flag, [] {
+        const int signal_numbers[] {SIGUSR1, SIGUSR2};
+        for (size_t index = 0; index < 2; ++index) {
+            struct sigaction action {};
+            action.sa_sigaction = _control_by_signal;
+            sigemptyset(&action.sa_mask);
+            action.sa_flags = SA_SIGINFO | SA_RESTART; // SA_RESTART: as std::signal, so that system calls are not interrupted
+            if (::sigaction(signal_numbers[index], &action, &_previous_control_actions()[index]) != 0) {
+                _previous_control_actions()[index] = {};
+                _previous_control_actions()[index].sa_handler = SIG_DFL;
+            }
+        }
+    });
+#endif
 }
 
-/// Returns a string representation of the container object.
-/// @param container the container object to output
-template <typename T, class Allocator>
-std::vector<std::string> to_strings(const std::deque<T, Allocator>& container) noexcept {
-    return _to_strings_container(container);
+/// Writes all pending log records and flushes the sink.
+/// In the binary recording and the Chrome trace, writes the records buffered by the current thread.
+inline void flush() noexcept {
+    auto writer = _async_writer.load(std::memory_order_acquire);
+    if (writer != nullptr)
+        writer->flush();
+    {
+        std::lock_guard<std::mutex> lock(_output_mutex);
+        _sink->flush();
+    }
+    _flush_binary_buffer(_context);
+    {
+        std::lock_guard<std::mutex> lock(_binary_mutex);
+        if (_binary_file != nullptr)
+            std::fflush(_binary_file);
+    }
+    _flush_chrome_buffer(_context);
+    std::lock_guard<std::mutex> lock(_chrome_mutex);
+    if (_chrome_file != nullptr)
+        std::fflush(_chrome_file);
 }
 
-/// Returns a string representation of the container object.
-/// @param container the container object to output
-template <typename T, class Allocator>
-std::vector<std::string> to_strings(const std::list<T, Allocator>& container) noexcept {
-    return _to_strings_container(container);
+/// Writes log lines, or keeps them while capturing a slow call.
+/// @param context the trace state of the thread
+/// @param log_str the log lines terminated with '\n' (its contents may be exchanged)
+/// @param is_message true if the lines are output by DEBUGTRACE_MESSAGE
+inline void _output_log(_Context& context, std::string& log_str, bool is_message) noexcept {
+    if (context.slow_call_depth > 0) {
+        if (context.slow_call_buffer.size() + log_str.size() <= slow_call_buffer_size)
+            context.slow_call_buffer += log_str;
+        else
+            context.slow_call_dropped_lines += (size_t)std::count(log_str.begin(), log_str.end(), '\n');
+        return;
+    }
+    _write_log(log_str, is_message);
 }
 
-/// Returns a string representation of the container object.
-/// @param container the container object to output
-template <typename Key, typename T, class Compare, class Allocator>
-std::vector<std::string> to_strings(const std::map<Key, T, Compare, Allocator>& container) noexcept {
-    return _to_strings_container(container);
+/// Outputs a log line.
+/// @param prefix the string output before the message (e.g. the variable name)
+/// @param message the message
+/// @param length the length of the message
+/// @param suffix the string output after the message (e.g. the source location)
+/// @param is_message true if the line is output by DEBUGTRACE_MESSAGE
+inline void _print_line(const std::string& prefix, const char* message, size_t length, const std::string& suffix,
+        bool is_message = false) noexcept {
+    auto& context = _context;
+    auto& log_str = context.log_buffer;
+    log_str.clear();
+    // the string received from the asynchronous queue is enlarged at once so that it can be reused for any line
+    if (log_str.capacity() < context.log_buffer_capacity)
+        log_str.reserve(context.log_buffer_capacity);
+    _append_log_datetime(log_str);
+    log_str += ' ';
+    if (thread_tag_enabled)
+        log_str += _get_thread_tag();
+    _append_code_indent_string(log_str);
+    log_str += prefix;
+    log_str.append(message, length);
+    log_str += suffix;
+    log_str += '\n';
+    context.log_buffer_capacity = std::max(context.log_buffer_capacity, log_str.capacity());
+    _output_log(context, log_str, is_message);
 }
 
-/// Returns a string representation of the container object.
-/// @param container the container object to output
-template <typename Key, typename T, class Compare, class Allocator>
-std::vector<std::string> to_strings(const std::multimap<Key, T, Compare, Allocator>& container) noexcept {
-    return _to_strings_container(container);
-}
+/// Outputs the lines of a value with a single write.
+/// The date and time, the thread tag and the code indent are built once and copied to each line.
+/// In the asynchronous mode, the lines are queued one by one so that the strings exchanged with the queue
+/// stay small enough to be reused (the writer thread writes them in batches anyway).
+/// @param prefix the string output before the first line (e.g. the variable name)
+/// @param buffer the lines
+/// @param suffix the string output after the last line (e.g. the source location)
+inline void _print_lines(const std::string& prefix, const Buffer& buffer, const std::string& suffix) noexcept {
+    static const std::string empty;
+    const auto line_count = buffer.line_count();
+    if (line_count > 1 && _async_writer.load(std::memory_order_acquire) != nullptr) {
+        for (size_t index = 0; index < line_count; ++index) {
+            const auto start = buffer.line_start(index);
+            _print_line(index == 0 ? prefix : empty, buffer.string().data() + start, buffer.line_end(index) - start,
+                index + 1 == line_count ? suffix : empty);
+        }
+        return;
+    }
 
-/// Returns a string representation of the container object.
-/// @param container the container object to output
-template <typename Key, typename T, class Hash, class Pred, class Allocator>
-std::vector<std::string> to_strings(const std::unordered_map<Key, T, Hash, Pred, Allocator>& container) noexcept {
-    return _to_strings_container(container);
+    auto& context = _context;
+    auto& log_str = context.log_buffer;
+    log_str.clear();
+    if (log_str.capacity() < context.log_buffer_capacity)
+        log_str.reserve(context.log_buffer_capacity);
+    _append_log_datetime(log_str);
+    log_str += ' ';
+    if (thread_tag_enabled)
+        log_str += _get_thread_tag();
+    _append_code_indent_string(log_str);
+    const auto head_size = log_str.size();
+    log_str += prefix;
+    for (size_t index = 0; index < line_count; ++index) {
+        if (index > 0)
+            log_str.append(log_str, 0, head_size);
+        const auto start = buffer.line_start(index);
+        log_str.append(buffer.string().data() + start, buffer.line_end(index) - start);
+        if (index + 1 == line_count)
+            log_str += suffix;
+        log_str += '\n';
+    }
+    context.log_buffer_capacity = std::max(context.log_buffer_capacity, log_str.capacity());
+    _output_log(context, log_str, false);
 }
 
-/// Returns a string representation of the container object.
-/// @param container the container object to output
-template <typename Key, typename T, class Hash, class Pred, class Allocator>
-std::vector<std::string> to_strings(const std::unordered_multimap<Key, T, Hash, Pred, Allocator>& container) noexcept {
-    return _to_strings_container(container);
+/// Outputs a log line.
+/// @param message the message
+/// @param suffix the string output after the message (e.g. the source location)
+inline void _print_line(const std::string& message, const std::string& suffix) noexcept {
+    _print_line(message, "", 0, suffix);
 }
 
-/// Returns a string representation of the container object.
-/// @param container the container object to output
-template <typename Key, class Compare, class Allocator>
-std::vector<std::string> to_strings(const std::set<Key, Compare, Allocator>& container) noexcept {
-    return _to_strings_container(container);
+inline void print_message(const std::string& message, const char file_name[] = "", int line_number = 0) noexcept {
+    _print_line(message, _get_location(file_name + _get_base_name_offset(file_name), line_number));
 }
 
-/// Returns a string representation of the container object.
-/// @param container the container object to output
-template <typename Key, class Compare, class Allocator>
-std::vector<std::string> to_strings(const std::multiset<Key, Compare, Allocator>& container) noexcept {
-    return _to_strings_container(container);
+/// Outputs the message of DEBUGTRACE_MESSAGE.
+/// @param site the call site
+/// @param message the message
+/// @param length the length of the message
+inline void print_message(_CallSite& site, const char* message, size_t length) noexcept {
+    static const std::string empty;
+    if (_flight_recording.load(std::memory_order_relaxed)) {
+        _add_flight_record(site, 'M', message, length);
+        return;
+    }
+    if (_chrome_tracing.load(std::memory_order_relaxed)) {
+        _trace_chrome_message(site, message, length);
+        return;
+    }
+    if (_binary_recording.load(std::memory_order_relaxed)) {
+        _append_bytes(_begin_binary_record(site, 'M'), message, length);
+        _end_binary_record();
+        return;
+    }
+    _print_line(empty, message, length, site.location, true);
 }
 
-/// Returns a string representation of the container object.
-/// @param container the container object to output
-template <typename Key, class Hash, class Pred, class Allocator>
-std::vector<std::string> to_strings(const std::unordered_set<Key, Hash, Pred, Allocator>& container) noexcept {
-    return _to_strings_container(container);
+/// Outputs the message of DEBUGTRACE_MESSAGE.
+/// @param site the call site
+/// @param message the message
+inline void print_message(_CallSite& site, const std::string& message) noexcept {
+    print_message(site, message.data(), message.size());
 }
 
-/// Returns a string representation of the container object.
-/// @param container the container object to output
-template <typename Key, class Hash, class Pred, class Allocator>
-std::vector<std::string> to_strings(const std::unordered_multiset<Key, Hash, Pred, Allocator>& container) noexcept {
-    return _to_strings_container(container);
+/// Outputs the message of DEBUGTRACE_MESSAGE without creating a temporary string.
+/// @param site the call site
+/// @param message the message
+inline void print_message(_CallSite& site, const char* message) noexcept {
+    print_message(site, message, std::strlen(message));
 }
 
-/// Returns a string representation of the container object.
-/// @param container the container object to output
-template <typename T, class Allocator>
-std::vector<std::string> to_strings(const std::vector<T, Allocator>& container) noexcept {
-    return _to_strings_container(container);
+/// Returns a random number for sampling (xorshift64*).
+inline uint64_t _get_random() noexcept {
+    auto& state = _context.random_state;
+    if (state == 0)
+        state = ((uint64_t)_get_steady_nanoseconds() ^ ((uint64_t)_get_thread_number() * 0x9E3779B97F4A7C15ull)) | 1;
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545F4914F6CDD1Dull;
 }
 
-/// Returns a string representation of the container object.
-/// @param container the container object to output
-template <class C>
-std::vector<std::string> _to_strings_container(const C& container) noexcept {
-    std::vector<std::string> strings;
-
-    auto one_line = true;
-
-    const auto type_str = _get_type_string(container, container.size());
-    auto string = type_str;
-    string += open_string;
-    auto delimiter = "";
-    auto count = (size_t)1;
-    for (const auto& value : container) {
-        string += delimiter;
-        if (count > collection_limit) {
-            string += limit_string;
-            break;
-        }
+inline void _Sampler::_configure(unsigned int generation) noexcept {
+    auto factor = 1.0;
+    {
+        _ConfigurationReader reader;
+        if (reader.get() != nullptr)
+            factor = reader.get()->sampling_factor;
+    }
+    // every n-th call with the factor 10 becomes every (n / 10)-th call
+    const auto parameter = _kind == kind::every ? _parameter / factor : _parameter * factor;
+    if (_kind == kind::probability)
+        _threshold.store(parameter >= 1.0 ? UINT64_MAX
+            : parameter <= 0.0 ? 0 : (uint64_t)(parameter * 18446744073709551616.0), std::memory_order_relaxed);
+    else
+        _limit.store(parameter < 1.0 ? 1 : (unsigned long long)parameter, std::memory_order_relaxed);
+    _generation.store(generation, std::memory_order_relaxed);
+}
 
-        const auto value_strings = to_strings(value);
-        if (value_strings.size() > 1) {
-            // the value string is not one line
-            one_line = false;
-            break;
-        }
-        string += value_strings.front();
+inline bool _Sampler::sample(_CallSite& site) noexcept {
+    // the parameters are set again only when the configuration is changed
+    const auto generation = _configuration_generation.load(std::memory_order_acquire);
+    if (generation != _generation.load(std::memory_order_relaxed))
+        _configure(generation);
 
-        if (string.size() > maximum_data_output_width) {
-            // multi lines
-            one_line = false;
-            break;
-        }
+    auto sampled = true;
+    long long now = 0;
+    switch (_kind) {
+    case kind::every:
+        sampled = _count.fetch_add(1, std::memory_order_relaxed) % _limit.load(std::memory_order_relaxed) == 0;
+        break;
+    case kind::probability: {
+        const auto threshold = _threshold.load(std::memory_order_relaxed);
+        sampled = threshold == UINT64_MAX || _get_random() < threshold;
+        break;
+    }
+    case kind::rate: {
+        // counts calls in each second of the steady clock (a few calls over the limit may pass when the second changes)
+        now = _get_steady_nanoseconds();
+        const auto second = now / 1000000000;
+        auto window = _window.load(std::memory_order_relaxed);
+        if (window != second && _window.compare_exchange_strong(window, second, std::memory_order_relaxed))
+            _count.store(0, std::memory_order_relaxed);
+        sampled = _count.fetch_add(1, std::memory_order_relaxed) < _limit.load(std::memory_order_relaxed);
+        break;
+    }
+    }
 
-        delimiter = ", ";
-        count += 1;
+    if (!sampled) {
+        _suppressed.fetch_add(1, std::memory_order_relaxed);
+        return false;
     }
+    if (_suppressed.load(std::memory_order_relaxed) != 0)
+        _summarize(site, now != 0 ? now : _get_steady_nanoseconds());
+    return true;
+}
 
-    if (one_line) {
-        // strings is one line
-        string += close_string;
-        strings.push_back(string);
+inline void _Sampler::_summarize(_CallSite& site, long long now) noexcept {
+    auto summary_time = _summary_time.load(std::memory_order_relaxed);
+    if (now - summary_time < sampling_summary_interval * 1000000LL
+        || !_summary_time.compare_exchange_strong(summary_time, now, std::memory_order_relaxed))
+        return;
+    const auto suppressed = _suppressed.exchange(0, std::memory_order_relaxed);
+    if (suppressed == 0)
+        return;
 
-    } else {
-        // strings is not one line
-        strings.push_back(type_str + open_string);
-        _data_nest_level += 1;
-        const auto indent_string = _get_data_indent_string();
-        count = 1;
-        for (const auto& value : container) {
-            if (count > collection_limit) {
-                strings.push_back(indent_string + limit_string);
-                break;
-            }
+    std::string message = "Suppressed ";
+    _append_grouped_integer(message, suppressed);
+    message += suppressed == 1 ? " call to " : " calls to ";
+    message += site.name != nullptr ? site.name : site.func_name;
+    char seconds[32];
+    std::snprintf(seconds, sizeof(seconds), " in last %.1fs", (double)(now - summary_time) / 1e9);
+    message += seconds;
+    print_message(site, message);
+}
 
-            const auto value_strings = to_strings(value);
-            auto is_first = true;
-            for (const auto& value_string : value_strings) {
-                if (is_first)
-                    strings.push_back(indent_string + value_string);
-                else
-                    strings.push_back(value_string);
-                is_first = false;
-            }
+/// Outputs the name and value of the variable.
+/// @param name_prefix the name of the variable followed by varname_value_separator
+/// @param value the value to output
+/// @param location the source location output after the last line
+template <typename T>
+void _print_value(const std::string& name_prefix, const T& value, const std::string& location) noexcept {
+    // the buffer is taken out of the context while in use in case to_buffer outputs another trace
+    Buffer buffer;
+    std::swap(buffer, _context.value_buffer);
+    buffer.clear();
+    to_buffer(buffer, value);
+    _print_lines(name_prefix, buffer, location);
+    std::swap(buffer, _context.value_buffer);
+}
 
-            strings.back() += ',';
-            count += 1;
-        }
+template <typename T>
+void print(const char* name, const T& value, const char file_name[] = "", int line_number = 0) noexcept {
+    _print_value(std::string(name) + varname_value_separator, value, print_location_enabled
+        ? _get_location(file_name + _get_base_name_offset(file_name), line_number) : std::string());
+}
 
-        _data_nest_level -= 1;
-        strings.push_back(_get_data_indent_string() + close_string);
+/// Outputs the name and value of the variable of DEBUGTRACE_PRINT.
+/// @param site the call site
+/// @param value the value to output
+template <typename T>
+void print(_CallSite& site, const T& value) noexcept {
+    if (_flight_recording.load(std::memory_order_relaxed)) {
+        _add_flight_value(site, value);
+        return;
     }
-
-    return strings;
+    if (_chrome_tracing.load(std::memory_order_relaxed)) {
+        _trace_chrome_value(site, value);
+        return;
+    }
+    if (_binary_recording.load(std::memory_order_relaxed)) {
+        _record_value(site, value, std::integral_constant<bool, _BinaryType<T>::value != 0>());
+        return;
+    }
+    _print_value(site.name_prefix, value, _get_print_location(site));
 }
 
-inline void print_message(std::string message, const char file_name[] = "", int line_number = 0) noexcept {
-    auto log_str = _get_log_datetime();
-    log_str += ' ';
-    log_str += _get_code_indent_string();
-    log_str += message;
-
-    if (file_name[0] != '\0') {
-        auto file_name2 = std::strrchr(file_name, '/');
-        if (file_name2 == nullptr) {
-            file_name2 = std::strrchr(file_name, '\\');
-            if (file_name2 == nullptr)
-                file_name2 = file_name;
-            else
-                ++file_name2;
-        } else
-            ++file_name2;
-
-        log_str += " (";
-        log_str += file_name2;
-        if (line_number > 0) {
-            log_str += pair_separator;
-            log_str += std::to_string(line_number);
-        }
-        log_str += ')';
-    }
+/// Appends the name and value of the last variable of DEBUGTRACE_PRINT with several variables.
+/// @param buffer the buffer to which the string is appended
+/// @param name_prefix the name of the variable followed by varname_value_separator
+/// @param value the value
+template <typename T>
+void _to_buffer_values(Buffer& buffer, const std::string* name_prefix, const T& value) noexcept {
+    buffer += *name_prefix;
+    to_buffer(buffer, value);
+}
 
-    output_stream << log_str << std::endl;
+/// Appends the names and values of the variables of DEBUGTRACE_PRINT with several variables separated by ", ".
+/// @param buffer the buffer to which the string is appended
+/// @param name_prefix the name of the first variable followed by varname_value_separator (and the others after it)
+/// @param value the first value
+/// @param values the other values
+template <typename T, typename... Ts>
+void _to_buffer_values(Buffer& buffer, const std::string* name_prefix, const T& value, const Ts&... values) noexcept {
+    _to_buffer_values(buffer, name_prefix, value);
+    buffer += ", ";
+    _to_buffer_values(buffer, name_prefix + 1, values...);
 }
 
-template <typename T>
-void print(const char* name, const T& value, const char file_name[] = "", int line_number = 0) noexcept {
-    _data_nest_level = 0;
-    const auto value_strings = to_strings(value);
-
-    auto index = 0;
-    for (const auto& value_string : value_strings) {
-        print_message(index == 0
-            ? std::string(name) + varname_value_separator + value_string
-            : value_string);
-        ++index;
+/// Outputs the names and values of the variables of DEBUGTRACE_PRINT with several variables as one record,
+/// which has a single date and time and source location and is written at once.
+/// The record is kept as a message in the binary recording, the Chrome trace and the flight recorder.
+/// @param site the call site
+/// @param value1 the first value
+/// @param value2 the second value
+/// @param values the other values
+template <typename T1, typename T2, typename... Ts>
+void print(_CallSite& site, const T1& value1, const T2& value2, const Ts&... values) noexcept {
+    static const std::string empty;
+    Buffer buffer;
+    std::swap(buffer, _context.value_buffer);
+    buffer.clear();
+    _to_buffer_values(buffer, site.name_prefixes.data(), value1, value2, values...);
+    if (_flight_recording.load(std::memory_order_relaxed)) {
+        _add_flight_record(site, 'M', buffer.string().data(), buffer.size());
+    } else if (_chrome_tracing.load(std::memory_order_relaxed)) {
+        _trace_chrome_message(site, buffer.string().data(), buffer.size());
+    } else if (_binary_recording.load(std::memory_order_relaxed)) {
+        _append_bytes(_begin_binary_record(site, 'M'), buffer.string().data(), buffer.size());
+        _end_binary_record();
+    } else {
+        _print_lines(empty, buffer, _get_print_location(site));
     }
+    std::swap(buffer, _context.value_buffer);
 }
 
 inline void _initialize() noexcept {
-    if (!_initialized) {
+    if (!_initialized.load(std::memory_order_acquire) && !_initialized.exchange(true)) {
         print_message(_start_message);
         print_message("");
-        _initialized = true;
     }
 }
 
@@ -904,37 +5055,135 @@ inline void _initialize() noexcept {
 /// then outputs execution trace of the program.
 class _DebugTrace {
 private:
-    const char* _func_name = nullptr;
-    const char* _file_name = nullptr;
+    /// How entering was traced (leaving is traced in the same way).
+    enum class mode : unsigned char {
+        none,     // not traced
+        text,     // output as lines
+        captured, // output as lines if the outermost scope is slow
+        binary,   // recorded in the binary format
+        chrome,   // written as Chrome trace events
+        flight,   // kept in the flight recorder
+        profile   // timed in the profiling mode
+    };
 
-public:
-    _DebugTrace() = delete;
-    _DebugTrace(_DebugTrace const&) = delete;
+    _CallSite& _site;
+    mode _mode = mode::none;
 
     /// Outputs a message when entering the function.
-    /// @param func_name the function name
-    /// @param file_name the source file name of the code that called this constructor
-    /// @param line_number the line number of the code that called this function
-    _DebugTrace(const char func_name[], const char file_name[], int line_number) noexcept {
+    void _enter() noexcept {
+        if (_profiling.load(std::memory_order_relaxed)) {
+            _mode = mode::profile;
+            _profile_enter(_site);
+            return;
+        }
+        if (_flight_recording.load(std::memory_order_relaxed)) {
+            _mode = mode::flight;
+            _add_flight_record(_site, 'E');
+            return;
+        }
+        if (_chrome_tracing.load(std::memory_order_relaxed)) {
+            _mode = mode::chrome;
+            _trace_chrome_scope(_site, 'B');
+            return;
+        }
+        if (_binary_recording.load(std::memory_order_relaxed)) {
+            _mode = mode::binary;
+            _begin_binary_record(_site, 'E');
+            _end_binary_record();
+            return;
+        }
+        _mode = mode::text;
         _initialize();
-        _func_name = func_name;
-        _file_name = file_name;
 
-        if (_before_code_nest_level > _code_nest_level)
+        auto& context = _context;
+        if (context.slow_call_depth > 0 || _slow_call_capture.load(std::memory_order_relaxed)) {
+            _mode = mode::captured;
+            if (context.slow_call_depth++ == 0) {
+                context.slow_call_buffer.clear();
+                context.slow_call_dropped_lines = 0;
+                context.slow_call_start = _get_steady_nanoseconds();
+            }
+        }
+        if (context.before_code_nest_level > context.code_nest_level)
             print_message("");
 
-        print_message(std::string(enter_string) + _func_name, _file_name, line_number);
+        _print_line(_site.enter_message, _site.location);
 
-        _before_code_nest_level = _code_nest_level;
-        ++_code_nest_level;
+        context.before_code_nest_level = context.code_nest_level;
+        ++context.code_nest_level;
     }
 
-    /// Outputs a message when leaving the function
-    ~_DebugTrace() noexcept {
-        _before_code_nest_level = _code_nest_level;
-        --_code_nest_level;
+    /// Outputs a message when leaving the function.
+    void _leave() noexcept {
+        if (_mode == mode::profile) {
+            _profile_leave();
+            return;
+        }
+        if (_mode == mode::flight) {
+            _add_flight_record(_site, 'L');
+            return;
+        }
+        if (_mode == mode::chrome) {
+            _trace_chrome_scope(_site, 'E');
+            return;
+        }
+        if (_mode == mode::binary) {
+            _begin_binary_record(_site, 'L');
+            _end_binary_record();
+            return;
+        }
+        auto& context = _context;
+        context.before_code_nest_level = context.code_nest_level;
+        --context.code_nest_level;
+
+        _print_line(_site.leave_message, _site.leave_location);
+        if (_mode == mode::captured && --context.slow_call_depth == 0)
+            _end_slow_call();
+    }
+
+    /// Outputs the lines captured in the outermost scope if the call was slow, or discards them.
+    void _end_slow_call() noexcept {
+        auto& context = _context;
+        const auto elapsed = _get_steady_nanoseconds() - context.slow_call_start;
+        if (elapsed < (_site.slow_call_threshold >= 0 ? _site.slow_call_threshold : slow_call_threshold))
+            return;
+        auto& lines = context.slow_call_buffer;
+        if (!lines.empty())
+            _write_log(lines);
+        lines.clear();
+        std::string message = "Slow call of ";
+        message += _site.func_name;
+        message += " took ";
+        _append_duration(message, elapsed);
+        if (context.slow_call_dropped_lines > 0)
+            message += " (" + std::to_string(context.slow_call_dropped_lines) + " lines dropped)";
+        _print_line(message, _site.leave_location);
+    }
+
+public:
+    _DebugTrace() = delete;
+    _DebugTrace(_DebugTrace const&) = delete;
+
+    /// Outputs a message when entering the function if category::enter is enabled and the call site is selected.
+    /// @param site the call site of DEBUGTRACE_ENTER
+    _DebugTrace(_CallSite& site) noexcept : _site(site) {
+        if (DEBUGTRACE_IS_ENABLED(category::enter) && _is_selected(site))
+            _enter();
+    }
+
+    /// Outputs a message when entering the function if category::enter is enabled,
+    /// the call site is selected and the call is sampled.
+    /// @param site the call site of DEBUGTRACE_ENTER_EVERY and so on
+    /// @param sampler the sampler of the call site
+    _DebugTrace(_CallSite& site, _Sampler& sampler) noexcept : _site(site) {
+        if (DEBUGTRACE_IS_ENABLED(category::enter) && _is_selected(site) && sampler.sample(site))
+            _enter();
+    }
 
-        print_message(std::string(leave_string) + _func_name, _file_name);
+    /// Outputs a message when leaving the function if entering was traced.
+    ~_DebugTrace() noexcept {
+        if (DEBUGTRACE_UNLIKELY(_mode != mode::none))
+            _leave();
     }
 
     _DebugTrace& operator =(const _DebugTrace&) = delete;
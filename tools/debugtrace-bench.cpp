@@ -0,0 +1,140 @@
+/// debugtrace-bench.cpp
+/// (C) 2017 Masato Kokubo
+///
+/// Measures the costs quoted for the runtime switch and the floating point formatting.
+/// Usage: debugtrace-bench [-n <count>] [disabled | floating]
+///   -n: the number of the calls of the disabled benchmark (default: 100000000)
+///   disabled: the cost of DEBUGTRACE_ENTER, DEBUGTRACE_PRINT and DEBUGTRACE_MESSAGE with tracing disabled
+///   floating: the cost of to_buffer of std::vector<double> and std::vector<float> with 1,000 elements
+/// Build with optimization, e.g. g++ -std=c++17 -O2 -pthread -o debugtrace-bench debugtrace-bench.cpp
+/// (-std=c++14 measures the fallback without std::to_chars).
+#ifndef DEBUGTRACE_ENABLED
+    #define DEBUGTRACE_ENABLED 1
+#endif
+#include "../include/debugtrace.hpp"
+#include <random>
+
+DEBUGTRACE_VARIABLES
+
+#if defined _MSC_VER
+    #define BENCH_NOINLINE __declspec(noinline)
+#else
+    #define BENCH_NOINLINE __attribute__((noinline))
+#endif
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+volatile int sink_value = 0;
+
+/// A function without tracing.
+BENCH_NOINLINE void empty_function(int value) {
+    sink_value = value;
+}
+
+/// The same function with tracing, which is called while tracing is disabled.
+BENCH_NOINLINE void traced_function(int value) {
+    DEBUGTRACE_ENTER
+    DEBUGTRACE_PRINT(value)
+    DEBUGTRACE_MESSAGE("traced_function")
+    sink_value = value;
+}
+
+/// Returns the nanoseconds taken by the calls of the function.
+template <typename F>
+double measure_calls(F function, long long count) {
+    const auto start = Clock::now();
+    for (long long index = 0; index < count; ++index)
+        function((int)index);
+    return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+}
+
+/// Measures the cost of the tracing macros while tracing is disabled.
+void bench_disabled(long long count) {
+    debugtrace::disable();
+    measure_calls(traced_function, count / 10); // warms up
+    const auto empty_ns = measure_calls(empty_function, count);
+    const auto traced_ns = measure_calls(traced_function, count);
+    std::printf("disabled: %lld calls\n", count);
+    std::printf("  empty function : %6.2f ns/call\n", empty_ns / (double)count);
+    std::printf("  traced function: %6.2f ns/call\n", traced_ns / (double)count);
+    std::printf("  difference     : %6.2f ns/call\n", (traced_ns - empty_ns) / (double)count);
+}
+
+/// Returns the nanoseconds per element taken by to_buffer of the container.
+template <typename T>
+double measure_to_buffer(const std::vector<T>& values, int repetition) {
+    debugtrace::Buffer buffer;
+    debugtrace::to_buffer(buffer, values); // warms up
+    const auto start = Clock::now();
+    for (auto index = 0; index < repetition; ++index) {
+        buffer.clear();
+        debugtrace::to_buffer(buffer, values);
+    }
+    const auto ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+    sink_value = (int)buffer.size();
+    return ns / ((double)repetition * (double)values.size());
+}
+
+/// Measures to_buffer of floating point numbers.
+void bench_floating() {
+    const size_t element_count = 1000;
+    const auto repetition = 200;
+    debugtrace::collection_limit = element_count;
+
+    std::mt19937_64 random(12345);
+    std::uniform_real_distribution<double> distribution(-1000.0, 1000.0);
+    std::vector<double> full_doubles, rounded_doubles;
+    std::vector<float> full_floats, rounded_floats;
+    for (size_t index = 0; index < element_count; ++index) {
+        const auto value = distribution(random);
+        full_doubles.push_back(value);
+        full_floats.push_back((float)value);
+        rounded_doubles.push_back((double)(long long)(value * 100.0) / 100.0);
+        rounded_floats.push_back((float)rounded_doubles.back());
+    }
+
+    std::printf("floating: to_buffer of %zu elements (%s), ns/element (double / float)\n", element_count,
+    #if defined __cpp_lib_to_chars
+        "std::to_chars"
+    #else
+        "snprintf fallback"
+    #endif
+    );
+    std::printf("  random full-precision values: %7.1f / %7.1f\n",
+        measure_to_buffer(full_doubles, repetition), measure_to_buffer(full_floats, repetition));
+    std::printf("  values with two decimals    : %7.1f / %7.1f\n",
+        measure_to_buffer(rounded_doubles, repetition), measure_to_buffer(rounded_floats, repetition));
+}
+
+} // namespace
+
+int main(int argc, const char* argv[]) {
+    long long count = 100000000;
+    auto run_disabled = true;
+    auto run_floating = true;
+    for (auto arg_index = 1; arg_index < argc; ++arg_index) {
+        const std::string arg = argv[arg_index];
+        if (arg == "-n" && arg_index + 1 < argc) {
+            count = std::atoll(argv[++arg_index]);
+        } else if (arg == "disabled") {
+            run_floating = false;
+        } else if (arg == "floating") {
+            run_disabled = false;
+        } else {
+            std::cerr << "Usage: debugtrace-bench [-n <count>] [disabled | floating]" << std::endl;
+            return 2;
+        }
+    }
+    if (count <= 0) {
+        std::cerr << "debugtrace-bench: the count must be positive" << std::endl;
+        return 2;
+    }
+
+    if (run_disabled)
+        bench_disabled(count);
+    if (run_floating)
+        bench_floating();
+    return 0;
+}
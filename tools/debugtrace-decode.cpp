@@ -0,0 +1,288 @@
+/// debugtrace-decode.cpp
+/// (C) 2017 Masato Kokubo
+///
+/// Converts a binary file recorded by debugtrace::start_binary_recording into the text format.
+/// Usage: debugtrace-decode [-p <precision>] [-t] <binary file>
+///   -p: the number of digits of the fraction of a second (0 to 9)
+///   -t: outputs the thread tags (e.g. "[1] "), as thread_tag_enabled does
+#ifndef DEBUGTRACE_ENABLED
+    #define DEBUGTRACE_ENABLED 1
+#endif
+#include "../include/debugtrace.hpp"
+#include <fstream>
+#include <stdexcept>
+
+DEBUGTRACE_VARIABLES
+
+namespace {
+
+/// A call site read from the binary file.
+struct Site {
+    std::string   func_name;
+    std::string   file_name;
+    int           line_number = 0;
+    std::string   name;
+    unsigned char type_id = 0;
+};
+
+/// A trace record read from the binary file.
+struct Record {
+    char          type = '\0';
+    uint64_t      timestamp = 0;
+    uint32_t      thread_number = 0;
+    uint32_t      site_id = 0;
+    size_t        tag_index = 0; // the tag of the thread name when recorded (0: the thread number)
+    std::string   payload;
+};
+
+/// The state of a thread while decoding.
+struct Thread {
+    std::string tag;
+    int code_nest_level = 0;
+    int before_code_nest_level = 0;
+};
+
+/// Reads the binary file.
+class Reader {
+private:
+    std::string _data;
+    size_t _position = 0;
+
+public:
+    explicit Reader(std::string data) : _data(std::move(data)) {}
+
+    bool at_end() const {return _position >= _data.size();}
+
+    template <typename T>
+    T read() {
+        T value{};
+        if (_position + sizeof(T) > _data.size())
+            throw std::runtime_error("Unexpected end of the file");
+        std::memcpy(&value, _data.data() + _position, sizeof(T));
+        _position += sizeof(T);
+        return value;
+    }
+
+    std::string read_bytes(size_t size) {
+        if (_position + size > _data.size())
+            throw std::runtime_error("Unexpected end of the file");
+        auto bytes = _data.substr(_position, size);
+        _position += size;
+        return bytes;
+    }
+
+    std::string read_string() {
+        return read_bytes(read<uint32_t>());
+    }
+};
+
+template <typename T>
+std::vector<std::string> to_strings(const std::string& bytes) {
+    if (bytes.size() != sizeof(T))
+        throw std::runtime_error("Invalid value size: " + std::to_string(bytes.size()));
+    T value;
+    std::memcpy(&value, bytes.data(), sizeof(T));
+    return debugtrace::to_strings(value);
+}
+
+/// Returns the string representation of a raw value.
+std::vector<std::string> value_to_strings(unsigned char type_id, const std::string& bytes) {
+    switch (type_id) {
+    case  1: return to_strings<bool              >(bytes);
+    case  2: return to_strings<char              >(bytes);
+    case  3: return to_strings<signed char       >(bytes);
+    case  4: return to_strings<unsigned char     >(bytes);
+    case  5: return to_strings<short             >(bytes);
+    case  6: return to_strings<unsigned short    >(bytes);
+    case  7: return to_strings<int               >(bytes);
+    case  8: return to_strings<unsigned int      >(bytes);
+    case  9: return to_strings<long              >(bytes);
+    case 10: return to_strings<unsigned long     >(bytes);
+    case 11: return to_strings<long long         >(bytes);
+    case 12: return to_strings<unsigned long long>(bytes);
+    case 13: return to_strings<float             >(bytes);
+    case 14: return to_strings<double            >(bytes);
+    case 15: return to_strings<long double       >(bytes);
+    case 16: return to_strings<wchar_t           >(bytes);
+    default: throw std::runtime_error("Unknown type id: " + std::to_string(type_id));
+    }
+}
+
+/// Returns the file name without the directory.
+std::string base_name(const std::string& file_name) {
+    const auto index = file_name.find_last_of("/\\");
+    return index == std::string::npos ? file_name : file_name.substr(index + 1);
+}
+
+/// Returns the date and time of a timestamp.
+std::string datetime(uint64_t timestamp) {
+    std::string string;
+    debugtrace::_append_log_datetime(string, (long long)timestamp);
+    return string;
+}
+
+/// Outputs a line in the text format.
+void print_line(std::ostream& stream, const Record& record, const Thread& thread, const std::string& message) {
+    stream << datetime(record.timestamp) << ' ';
+    if (debugtrace::thread_tag_enabled)
+        stream << thread.tag;
+    for (auto index = 0; index < thread.code_nest_level && index < debugtrace::maximum_indents; ++index)
+        stream << debugtrace::code_indent_string;
+    stream << message << '\n';
+}
+
+/// Returns the source location of a call site.
+std::string location(const Site& site) {
+    return " (" + base_name(site.file_name) + debugtrace::pair_separator + std::to_string(site.line_number) + ')';
+}
+
+/// Outputs the lines of a value.
+void print_lines(std::ostream& stream, const Record& record, const Thread& thread, const Site& site,
+        const std::vector<std::string>& lines) {
+    size_t index = 0;
+    for (const auto& line : lines) {
+        print_line(stream, record, thread, (index == 0 ? site.name + debugtrace::varname_value_separator + line : line)
+            + (index + 1 == lines.size() && debugtrace::print_location_enabled ? location(site) : ""));
+        ++index;
+    }
+}
+
+/// Splits a text into lines.
+std::vector<std::string> split_lines(const std::string& text) {
+    std::vector<std::string> lines;
+    size_t start = 0;
+    for (;;) {
+        const auto end = text.find('\n', start);
+        lines.push_back(text.substr(start, end == std::string::npos ? std::string::npos : end - start));
+        if (end == std::string::npos)
+            break;
+        start = end + 1;
+    }
+    return lines;
+}
+
+/// Decodes a binary file.
+void decode(const std::string& data, std::ostream& stream) {
+    const auto magic_size = sizeof(DEBUGTRACE_BINARY_MAGIC) - 1;
+    if (data.compare(0, magic_size, DEBUGTRACE_BINARY_MAGIC) != 0)
+        throw std::runtime_error("Not a DebugTrace-cpp binary file");
+
+    std::map<uint32_t, Site> sites;
+    std::map<uint32_t, Thread> threads;
+    std::vector<Record> records;
+    // a thread renamed while recording is defined again, so the tag is taken when each record is read
+    std::vector<std::string> tags(1);
+    std::map<uint32_t, size_t> tag_indexes;
+
+    Reader reader(data.substr(magic_size));
+    while (!reader.at_end()) {
+        const auto type = reader.read<char>();
+        if (type == 'N') {
+            const auto thread_number = reader.read<uint32_t>();
+            const auto name = reader.read_string();
+            if (name.empty()) {
+                tag_indexes[thread_number] = 0;
+            } else {
+                tags.push_back('[' + name + "] ");
+                tag_indexes[thread_number] = tags.size() - 1;
+            }
+        } else if (type == 'S') {
+            const auto id = reader.read<uint32_t>();
+            auto& site = sites[id];
+            site.line_number = reader.read<int32_t>();
+            site.type_id = reader.read<unsigned char>();
+            site.func_name = reader.read_string();
+            site.file_name = reader.read_string();
+            site.name = reader.read_string();
+        } else {
+            Record record;
+            record.type = type;
+            record.timestamp = reader.read<uint64_t>();
+            record.thread_number = reader.read<uint32_t>();
+            record.site_id = reader.read<uint32_t>();
+            record.tag_index = tag_indexes[record.thread_number];
+            if (type == 'V') {
+                record.payload = reader.read_bytes(reader.read<unsigned char>());
+            } else if (type == 'T' || type == 'M') {
+                record.payload = reader.read_string();
+            } else if (type != 'E' && type != 'L') {
+                throw std::runtime_error(std::string("Unknown record type: ") + type);
+            }
+            records.push_back(std::move(record));
+        }
+    }
+
+    // Records are buffered per thread, so they are sorted into the order of time.
+    std::stable_sort(records.begin(), records.end(),
+        [](const Record& record1, const Record& record2) {return record1.timestamp < record2.timestamp;});
+
+    for (const auto& record : records) {
+        const auto& site = sites[record.site_id];
+        auto& thread = threads[record.thread_number];
+        thread.tag = record.tag_index != 0 ? tags[record.tag_index]
+            : '[' + std::to_string(record.thread_number) + "] ";
+
+        switch (record.type) {
+        case 'E':
+            if (thread.before_code_nest_level > thread.code_nest_level)
+                print_line(stream, record, thread, "");
+            print_line(stream, record, thread, debugtrace::enter_string + site.func_name + location(site));
+            thread.before_code_nest_level = thread.code_nest_level;
+            ++thread.code_nest_level;
+            break;
+        case 'L':
+            thread.before_code_nest_level = thread.code_nest_level;
+            --thread.code_nest_level;
+            print_line(stream, record, thread, debugtrace::leave_string + site.func_name
+                + " (" + base_name(site.file_name) + ')');
+            break;
+        case 'V':
+            print_lines(stream, record, thread, site, value_to_strings(site.type_id, record.payload));
+            break;
+        case 'T':
+            print_lines(stream, record, thread, site, split_lines(record.payload));
+            break;
+        case 'M': {
+            // a record of DEBUGTRACE_PRINT with several variables (whose call site has the names) may have several lines
+            const auto lines = split_lines(record.payload);
+            const auto with_location = site.name.empty() || debugtrace::print_location_enabled;
+            for (size_t index = 0; index < lines.size(); ++index)
+                print_line(stream, record, thread, lines[index] + (index + 1 == lines.size() && with_location ? location(site) : ""));
+            break;
+        }
+        }
+    }
+}
+
+} // namespace
+
+int main(int argc, const char* argv[]) {
+    auto arg_index = 1;
+    for (; arg_index < argc - 1; ++arg_index) {
+        const std::string arg = argv[arg_index];
+        if (arg == "-p" && arg_index + 2 < argc)
+            debugtrace::log_datetime_precision = std::atoi(argv[++arg_index]);
+        else if (arg == "-t")
+            debugtrace::thread_tag_enabled = true;
+        else
+            break;
+    }
+    if (arg_index != argc - 1) {
+        std::cerr << "Usage: debugtrace-decode [-p <precision>] [-t] <binary file>" << std::endl;
+        return 2;
+    }
+    std::ifstream file(argv[arg_index], std::ios::binary);
+    if (!file) {
+        std::cerr << "Cannot open " << argv[arg_index] << std::endl;
+        return 1;
+    }
+    const std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    try {
+        decode(data, std::cout);
+    } catch (const std::exception& e) {
+        std::cout.flush();
+        std::cerr << "debugtrace-decode: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}